@@ -715,7 +715,8 @@ static int amdgpu_destroy_bo(struct bo *bo)
 		return drv_gem_bo_destroy(bo);
 }
 
-static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, uint32_t map_flags)
+static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, const struct rectangle *rect,
+			   uint32_t map_flags)
 {
 	void *addr = MAP_FAILED;
 	int ret;
@@ -727,7 +728,7 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, uint32_t map_flags)
 	struct amdgpu_priv *drv_priv = bo->drv->priv;
 
 	if (bo->priv)
-		return dri_bo_map(drv_priv->dri, bo, vma, 0, map_flags);
+		return dri_bo_map(drv_priv->dri, bo, vma, rect, 0, map_flags);
 
 	gem_op.handle = handle;
 	gem_op.op = AMDGPU_GEM_OP_GET_GEM_CREATE_INFO;
@@ -868,8 +869,10 @@ const struct backend backend_amdgpu = {
 	.bo_release = amdgpu_release_bo,
 	.bo_destroy = amdgpu_destroy_bo,
 	.bo_import = amdgpu_import_bo,
-	.bo_map = amdgpu_map_bo,
+	.bo_map_rect = amdgpu_map_bo,
 	.bo_unmap = amdgpu_unmap_bo,
+	/* SDMA staging of linear VRAM bos and mapImage/hbm staging of the others */
+	.bo_map_copies = true,
 	.bo_invalidate = amdgpu_bo_invalidate,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 	.num_planes_from_modifier = amdgpu_num_planes_from_modifier,
@@ -32,7 +32,13 @@ inline ndk::ScopedAStatus ToBinderStatus(AllocationError error) {
 
 bool Allocator::init() {
     mDriver = cros_gralloc_driver::get_instance();
-    return mDriver != nullptr;
+    if (!mDriver) {
+        return false;
+    }
+
+    mDriver->set_allocator_service();
+    mDriver->enable_preallocation();
+    return true;
 }
 
 // TODO(natsu): deduplicate with CrosGralloc4Allocator after the T release.
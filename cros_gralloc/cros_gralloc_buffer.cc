@@ -8,13 +8,116 @@
 
 #include <assert.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <utility>
 
 #include <cutils/native_handle.h>
 
+/*
+ * Persistent mappings pin CPU address space while they live, so the total is capped. When a new
+ * one does not fit, idle ones are torn down least recently unlocked first; buffers that still do
+ * not fit fall back to mapping on every lock().
+ */
+#if defined(__LP64__)
+static constexpr uint64_t kPersistentMapBudget = 4ull << 30;
+#else
+static constexpr uint64_t kPersistentMapBudget = 256ull << 20;
+#endif
+static std::atomic<uint64_t> persistent_map_bytes{ 0 };
+/* Buffers holding a persistent mapping, least recently unlocked first. */
+static std::mutex persistent_maps_mutex;
+static std::list<cros_gralloc_buffer *> persistent_maps;
+
+static bool reserve_persistent_map(uint64_t size)
+{
+	uint64_t used = persistent_map_bytes.load(std::memory_order_relaxed);
+	do {
+		if (used + size > kPersistentMapBudget)
+			return false;
+	} while (!persistent_map_bytes.compare_exchange_weak(used, used + size,
+							      std::memory_order_relaxed));
+	return true;
+}
+
+static void release_persistent_map(uint64_t size)
+{
+	persistent_map_bytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+/*
+ * Reserved regions carved out of a shared arena would otherwise cost a mapping each; every
+ * reserved region file is therefore mapped once per process and shared between buffers.
+ */
+struct reserved_region_mapping {
+	void *addr;
+	uint64_t size;
+	int32_t refcount;
+};
+
+static std::mutex reserved_region_mappings_mutex;
+static std::map<std::pair<dev_t, ino_t>, reserved_region_mapping> reserved_region_mappings;
+
+static void *acquire_reserved_region_mapping(int fd, uint64_t end,
+					     std::pair<dev_t, ino_t> *out_key)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		ALOGE("Failed to stat reserved region: %s.", strerror(errno));
+		return MAP_FAILED;
+	}
+
+	auto key = std::make_pair(st.st_dev, st.st_ino);
+	std::lock_guard<std::mutex> lock(reserved_region_mappings_mutex);
+
+	auto it = reserved_region_mappings.find(key);
+	if (it == reserved_region_mappings.end()) {
+		uint64_t size = st.st_size > 0 ? st.st_size : end;
+		if (size < end) {
+			ALOGE("Reserved region exceeds its file.");
+			return MAP_FAILED;
+		}
+
+		void *addr = mmap(nullptr, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			ALOGE("Failed to mmap reserved region: %s.", strerror(errno));
+			return MAP_FAILED;
+		}
+
+		it = reserved_region_mappings.emplace(key, reserved_region_mapping{ addr, size, 0 })
+			 .first;
+	} else if (it->second.size < end) {
+		ALOGE("Reserved region exceeds its file.");
+		return MAP_FAILED;
+	}
+
+	it->second.refcount++;
+	*out_key = key;
+	return it->second.addr;
+}
+
+static void release_reserved_region_mapping(const std::pair<dev_t, ino_t> &key)
+{
+	std::lock_guard<std::mutex> lock(reserved_region_mappings_mutex);
+
+	auto it = reserved_region_mappings.find(key);
+	assert(it != reserved_region_mappings.end());
+	if (--it->second.refcount)
+		return;
+
+	munmap(it->second.addr, it->second.size);
+	reserved_region_mappings.erase(it);
+}
+
 /*static*/
 std::unique_ptr<cros_gralloc_buffer>
 cros_gralloc_buffer::create(struct bo *acquire_bo,
-			    const struct cros_gralloc_handle *borrowed_handle)
+			    const struct cros_gralloc_handle *borrowed_handle, ino_t import_inode)
 {
 	auto acquire_hnd =
 	    reinterpret_cast<struct cros_gralloc_handle *>(native_handle_clone(borrowed_handle));
@@ -24,7 +127,7 @@ cros_gralloc_buffer::create(struct bo *acquire_bo,
 	}
 
 	std::unique_ptr<cros_gralloc_buffer> buffer(
-	    new cros_gralloc_buffer(acquire_bo, acquire_hnd));
+	    new cros_gralloc_buffer(acquire_bo, acquire_hnd, import_inode));
 	if (!buffer) {
 		ALOGE("Failed to create cros_gralloc_buffer: failed to allocate.");
 		native_handle_close(acquire_hnd);
@@ -36,8 +139,9 @@ cros_gralloc_buffer::create(struct bo *acquire_bo,
 }
 
 cros_gralloc_buffer::cros_gralloc_buffer(struct bo *acquire_bo,
-					 struct cros_gralloc_handle *acquire_handle)
-    : bo_(acquire_bo), hnd_(acquire_handle)
+					 struct cros_gralloc_handle *acquire_handle,
+					 ino_t import_inode)
+    : bo_(acquire_bo), hnd_(acquire_handle), import_inode_(import_inode)
 {
 	assert(bo_);
 	assert(hnd_);
@@ -47,10 +151,19 @@ cros_gralloc_buffer::cros_gralloc_buffer(struct bo *acquire_bo,
 
 cros_gralloc_buffer::~cros_gralloc_buffer()
 {
-	drv_bo_destroy(bo_);
-	if (reserved_region_addr_) {
-		munmap(reserved_region_addr_, hnd_->reserved_region_size);
+	{
+		std::lock_guard<std::mutex> lock(persistent_maps_mutex);
+		if (persistent_map_)
+			persistent_maps.erase(persistent_map_it_);
 	}
+	if (persistent_map_) {
+		if (lock_data_[0])
+			drv_bo_unmap(bo_, lock_data_[0]);
+		release_persistent_map(hnd_->total_size);
+	}
+	drv_bo_destroy(bo_);
+	if (reserved_region_addr_)
+		release_reserved_region_mapping(reserved_region_key_);
 	native_handle_close(hnd_);
 	native_handle_delete(hnd_);
 }
@@ -85,6 +198,11 @@ uint64_t cros_gralloc_buffer::get_format_modifier() const
 	return hnd_->format_modifier;
 }
 
+uint64_t cros_gralloc_buffer::get_use_flags() const
+{
+	return hnd_->use_flags;
+}
+
 uint64_t cros_gralloc_buffer::get_total_size() const
 {
 	return hnd_->total_size;
@@ -95,6 +213,11 @@ uint32_t cros_gralloc_buffer::get_num_planes() const
 	return hnd_->num_planes;
 }
 
+uint32_t cros_gralloc_buffer::get_num_fds() const
+{
+	return hnd_->numFds;
+}
+
 uint32_t cros_gralloc_buffer::get_plane_offset(uint32_t plane) const
 {
 	return hnd_->offsets[plane];
@@ -120,6 +243,11 @@ int64_t cros_gralloc_buffer::get_android_usage() const
 	return hnd_->usage;
 }
 
+ino_t cros_gralloc_buffer::get_import_inode() const
+{
+	return import_inode_;
+}
+
 int32_t cros_gralloc_buffer::increase_refcount()
 {
 	return ++refcount_;
@@ -131,57 +259,197 @@ int32_t cros_gralloc_buffer::decrease_refcount()
 	return --refcount_;
 }
 
+/*
+ * Populates the page tables of a new mapping up front, so that the first CPU access after the
+ * acquire fence signals does not fault. Best effort: older kernels lack MADV_POPULATE_*.
+ */
+static void prefault_mapping(const struct mapping *mapping, uint32_t map_flags)
+{
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+	if (!mapping->vma->length)
+		return;
+
+	madvise(mapping->vma->addr, mapping->vma->length,
+		(map_flags & BO_MAP_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ);
+#endif
+}
+
 int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_flags,
+				  int32_t acquire_fence, bool close_acquire_fence,
 				  uint8_t *addr[DRV_MAX_PLANES])
 {
 	void *vaddr = nullptr;
+	struct mapping *mapping = nullptr;
+	int32_t ret;
 
 	memset(addr, 0, DRV_MAX_PLANES * sizeof(*addr));
 
-	if (map_flags) {
-		if (lock_data_[0]) {
-			drv_bo_invalidate(bo_, lock_data_[0]);
-			vaddr = lock_data_[0]->vma->addr;
-		} else {
-			struct rectangle r = *rect;
+	/*
+	 * Backends that stage the buffer through a copy read it inside drv_bo_map(), so the device
+	 * has to be done with it first.
+	 */
+	if (map_flags && drv_bo_map_copies(bo_)) {
+		ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
+		if (ret) {
+			if (close_acquire_fence && acquire_fence >= 0)
+				close(acquire_fence);
+			return ret;
+		}
+		acquire_fence = -1;
+	}
 
-			if (!r.width && !r.height && !r.x && !r.y) {
+	/*
+	 * Otherwise the mapping is set up while the acquire fence may still be pending; only the
+	 * invalidate has to wait for the device. The pending lock is already counted so that a
+	 * concurrent unlock() does not tear the mapping down underneath it.
+	 */
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (map_flags) {
+			if (lock_data_[0]) {
+				vaddr = lock_data_[0]->vma->addr;
+			} else if ((vaddr = map_persistent(map_flags)) != MAP_FAILED) {
+				prefault_mapping(lock_data_[0], map_flags);
+			} else {
 				/*
-				 * Android IMapper.hal: An accessRegion of all-zeros means the
-				 * entire buffer.
+				 * Map the whole buffer rather than the access region: backends may
+				 * map only the requested rect, and lock_data_[0] is shared with
+				 * later locks for other regions.
 				 */
-				r.width = drv_bo_get_width(bo_);
-				r.height = drv_bo_get_height(bo_);
+				struct rectangle r = { 0, 0, drv_bo_get_width(bo_),
+						       drv_bo_get_height(bo_) };
+
+				vaddr = drv_bo_map(bo_, &r, map_flags | BO_MAP_DEFER_INVALIDATE,
+						   &lock_data_[0], 0);
+				if (vaddr != MAP_FAILED)
+					prefault_mapping(lock_data_[0], map_flags);
 			}
 
-			vaddr = drv_bo_map(bo_, &r, map_flags, &lock_data_[0], 0);
-		}
+			if (vaddr == MAP_FAILED) {
+				ALOGE("Mapping failed.");
+				if (close_acquire_fence && acquire_fence >= 0)
+					close(acquire_fence);
+				return -EFAULT;
+			}
 
-		if (vaddr == MAP_FAILED) {
-			ALOGE("Mapping failed.");
-			return -EFAULT;
+			mapping = lock_data_[0];
 		}
+
+		lockcount_++;
+	}
+
+	ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
+	if (ret) {
+		int32_t release_fence;
+
+		unlock(&release_fence);
+		if (release_fence >= 0)
+			close(release_fence);
+		return ret;
+	}
+
+	if (mapping) {
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		drv_bo_invalidate(bo_, mapping);
+		if (persistent_map_ && (map_flags & BO_MAP_WRITE))
+			persistent_map_written_ = true;
 	}
 
 	for (uint32_t plane = 0; plane < hnd_->num_planes; plane++)
 		addr[plane] = static_cast<uint8_t *>(vaddr) + drv_bo_get_plane_offset(bo_, plane);
 
-	lockcount_++;
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::unlock()
+void *cros_gralloc_buffer::map_persistent(uint32_t map_flags)
 {
+	if (!(hnd_->use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)))
+		return MAP_FAILED;
+
+	/* Map with every access the usage allows so later locks can share the mapping. */
+	uint32_t flags = cros_gralloc_convert_map_usage(hnd_->usage);
+	if (map_flags & ~flags)
+		return MAP_FAILED;
+
+	/*
+	 * A backend that stages the buffer through a copy only writes it back on unmap, so the
+	 * mapping would go stale across unlock().
+	 */
+	if (drv_bo_map_copies(bo_))
+		return MAP_FAILED;
+
+	if (!reserve_persistent_map(hnd_->total_size)) {
+		evict_persistent_maps(hnd_->total_size);
+		if (!reserve_persistent_map(hnd_->total_size))
+			return MAP_FAILED;
+	}
+
+	struct rectangle r = { 0, 0, drv_bo_get_width(bo_), drv_bo_get_height(bo_) };
+	void *vaddr = drv_bo_map(bo_, &r, flags | BO_MAP_PERSISTENT | BO_MAP_DEFER_INVALIDATE,
+				 &lock_data_[0], 0);
+	if (vaddr == MAP_FAILED) {
+		lock_data_[0] = nullptr;
+		release_persistent_map(hnd_->total_size);
+		return MAP_FAILED;
+	}
+
+	std::lock_guard<std::mutex> lock(persistent_maps_mutex);
+	persistent_map_it_ = persistent_maps.insert(persistent_maps.end(), this);
+	persistent_map_ = true;
+	return vaddr;
+}
+
+/* Tears down idle persistent mappings, least recently unlocked first, until |size| bytes fit. */
+void cros_gralloc_buffer::evict_persistent_maps(uint64_t size)
+{
+	std::lock_guard<std::mutex> lock(persistent_maps_mutex);
+
+	auto it = persistent_maps.begin();
+	while (it != persistent_maps.end() &&
+	       persistent_map_bytes.load(std::memory_order_relaxed) + size > kPersistentMapBudget) {
+		cros_gralloc_buffer *buffer = *it;
+
+		/* The caller holds its own buffer lock, so never block on another one. */
+		std::unique_lock<std::mutex> buffer_lock(buffer->mutex_, std::try_to_lock);
+		if (!buffer_lock.owns_lock() || buffer->lockcount_) {
+			++it;
+			continue;
+		}
+
+		drv_bo_unmap(buffer->bo_, buffer->lock_data_[0]);
+		buffer->lock_data_[0] = nullptr;
+		buffer->persistent_map_ = false;
+		release_persistent_map(buffer->hnd_->total_size);
+		it = persistent_maps.erase(it);
+	}
+}
+
+int32_t cros_gralloc_buffer::unlock(int32_t *release_fence)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	*release_fence = -1;
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
 	}
 
 	if (!--lockcount_) {
-		if (lock_data_[0]) {
-			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
+		/* The write-back is only started here; the fence tells when it completes. */
+		if (persistent_map_) {
+			if (persistent_map_written_)
+				drv_bo_flush_fence(bo_, lock_data_[0], release_fence);
+
+			std::lock_guard<std::mutex> maps_lock(persistent_maps_mutex);
+			persistent_maps.splice(persistent_maps.end(), persistent_maps, persistent_map_it_);
+		} else if (lock_data_[0]) {
+			drv_bo_flush_or_unmap_fence(bo_, lock_data_[0], release_fence);
 			lock_data_[0] = nullptr;
 		}
+		persistent_map_written_ = false;
 	}
 
 	return 0;
@@ -196,6 +464,8 @@ int32_t cros_gralloc_buffer::resource_info(uint32_t strides[DRV_MAX_PLANES],
 
 int32_t cros_gralloc_buffer::invalidate()
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -209,6 +479,8 @@ int32_t cros_gralloc_buffer::invalidate()
 
 int32_t cros_gralloc_buffer::flush()
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -222,6 +494,8 @@ int32_t cros_gralloc_buffer::flush()
 
 int32_t cros_gralloc_buffer::get_reserved_region(void **addr, uint64_t *size) const
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	int32_t reserved_region_fd = hnd_->fds[hnd_->num_planes];
 	if (reserved_region_fd < 0) {
 		ALOGE("Buffer does not have reserved region.");
@@ -229,16 +503,21 @@ int32_t cros_gralloc_buffer::get_reserved_region(void **addr, uint64_t *size) co
 	}
 
 	if (!reserved_region_addr_) {
-		reserved_region_addr_ =
-		    mmap(nullptr, hnd_->reserved_region_size, PROT_WRITE | PROT_READ, MAP_SHARED,
-			 reserved_region_fd, 0);
-		if (reserved_region_addr_ == MAP_FAILED) {
-			ALOGE("Failed to mmap reserved region: %s.", strerror(errno));
-			return -errno;
-		}
+		void *base = acquire_reserved_region_mapping(
+		    reserved_region_fd, hnd_->reserved_region_offset + hnd_->reserved_region_size,
+		    &reserved_region_key_);
+		if (base == MAP_FAILED)
+			return -EINVAL;
+
+		reserved_region_addr_ = static_cast<uint8_t *>(base) + hnd_->reserved_region_offset;
 	}
 
 	*addr = reserved_region_addr_;
 	*size = hnd_->reserved_region_size;
 	return 0;
 }
+
+uint64_t cros_gralloc_buffer::get_reserved_region_size() const
+{
+	return hnd_->reserved_region_size;
+}
@@ -7,7 +7,12 @@
 #ifndef CROS_GRALLOC_BUFFER_H
 #define CROS_GRALLOC_BUFFER_H
 
+#include <list>
 #include <memory>
+#include <mutex>
+#include <utility>
+
+#include <sys/types.h>
 
 #include "cros_gralloc_helpers.h"
 
@@ -15,7 +20,8 @@ class cros_gralloc_buffer
 {
       public:
 	static std::unique_ptr<cros_gralloc_buffer>
-	create(struct bo *acquire_bo, const struct cros_gralloc_handle *borrowed_handle);
+	create(struct bo *acquire_bo, const struct cros_gralloc_handle *borrowed_handle,
+	       ino_t import_inode);
 
 	~cros_gralloc_buffer();
 
@@ -25,21 +31,34 @@ class cros_gralloc_buffer
 	uint32_t get_height() const;
 	uint32_t get_format() const;
 	uint64_t get_format_modifier() const;
+	uint64_t get_use_flags() const;
 	uint64_t get_total_size() const;
 	uint32_t get_num_planes() const;
+	uint32_t get_num_fds() const;
 	uint32_t get_plane_offset(uint32_t plane) const;
 	uint32_t get_plane_stride(uint32_t plane) const;
 	uint32_t get_plane_size(uint32_t plane) const;
 	int32_t get_android_format() const;
 	int64_t get_android_usage() const;
+	/* Inode of the first fd of an imported buffer, or 0 for buffers allocated here. */
+	ino_t get_import_inode() const;
 
 	/* The new reference count is returned by both these functions. */
 	int32_t increase_refcount();
 	int32_t decrease_refcount();
 
-	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
-		     uint8_t *addr[DRV_MAX_PLANES]);
-	int32_t unlock();
+	/*
+	 * Maps the whole buffer regardless of the access region |rect|. Waits for |acquire_fence|
+	 * (closing it if |close_acquire_fence| is set) before the mapping is invalidated and
+	 * returned.
+	 */
+	int32_t lock(const struct rectangle *rect, uint32_t map_flags, int32_t acquire_fence,
+		     bool close_acquire_fence, uint8_t *addr[DRV_MAX_PLANES]);
+	/*
+	 * On success |release_fence| is either -1 or a sync_file fd owned by the caller that
+	 * signals once the CPU writes are visible to the device.
+	 */
+	int32_t unlock(int32_t *release_fence);
 	int32_t resource_info(uint32_t strides[DRV_MAX_PLANES], uint32_t offsets[DRV_MAX_PLANES],
 			      uint64_t *format_modifier);
 
@@ -48,25 +67,49 @@ class cros_gralloc_buffer
 
 	int32_t get_reserved_region(void **reserved_region_addr,
 				    uint64_t *reserved_region_size) const;
+	uint64_t get_reserved_region_size() const;
 
       private:
-	cros_gralloc_buffer(struct bo *acquire_bo, struct cros_gralloc_handle *acquire_handle);
+	cros_gralloc_buffer(struct bo *acquire_bo, struct cros_gralloc_handle *acquire_handle,
+			    ino_t import_inode);
 
 	cros_gralloc_buffer(cros_gralloc_buffer const &);
 	cros_gralloc_buffer operator=(cros_gralloc_buffer const &);
 
+	void *map_persistent(uint32_t map_flags);
+	static void evict_persistent_maps(uint64_t size);
+
 	struct bo *bo_;
 
 	/* Note: this will be nullptr for imported/retained buffers. */
 	struct cros_gralloc_handle *hnd_;
 
+	ino_t import_inode_;
+
+	/* Only changed with the owning cros_gralloc_driver shard lock held. */
 	int32_t refcount_ = 1;
+
+	/* Protects the lock state and reserved region mapping below. */
+	mutable std::mutex mutex_;
 	int32_t lockcount_ = 0;
 
 	struct mapping *lock_data_[DRV_MAX_PLANES];
 
-	/* Optional additional shared memory region attached to some gralloc buffers. */
+	/*
+	 * SW_*_OFTEN buffers keep lock_data_[0] mapped across unlock(): the mapping is only
+	 * invalidated on the first lock() and flushed on the last unlock(). Idle mappings are torn
+	 * down again when new ones would not fit in the persistent mapping budget.
+	 */
+	bool persistent_map_ = false;
+	bool persistent_map_written_ = false;
+	std::list<cros_gralloc_buffer *>::iterator persistent_map_it_;
+
+	/*
+	 * Optional additional shared memory region attached to some gralloc buffers. The mapping
+	 * of its file is shared by all buffers in the process whose regions live in that file.
+	 */
 	mutable void *reserved_region_addr_ = nullptr;
+	mutable std::pair<dev_t, ino_t> reserved_region_key_;
 };
 
 #endif
@@ -6,12 +6,16 @@
 
 #include "cros_gralloc_driver.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cutils/properties.h>
 #include <fcntl.h>
 #include <hardware/gralloc.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <syscall.h>
+#include <thread>
 #include <xf86drm.h>
 
 #include "../util.h"
@@ -168,14 +172,68 @@ static void drv_destroy_and_close(struct driver *drv)
 		close(fd);
 }
 
+static ino_t get_fd_inode(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return 0;
+
+	return st.st_ino;
+}
+
 cros_gralloc_driver::cros_gralloc_driver() : drv_(init_try_nodes(), drv_destroy_and_close)
 {
+	use_reserved_arena_ = property_get_bool("ro.vendor.minigbm.reserved_region_arena", false);
+
+	memory_soft_budget_ = std::max<int64_t>(
+	    property_get_int64("ro.vendor.minigbm.memory_budget.soft_mb", 0), 0) << 20;
+	memory_hard_budget_ = std::max<int64_t>(
+	    property_get_int64("ro.vendor.minigbm.memory_budget.hard_mb", 0), 0) << 20;
+
+	// Leave the bulk of the fd limit to the process itself.
+	struct rlimit rlim;
+	import_cache_max_fds_ = 256;
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur != RLIM_INFINITY)
+		import_cache_max_fds_ = std::min<rlim_t>(import_cache_max_fds_, rlim.rlim_cur / 16);
 }
 
 cros_gralloc_driver::~cros_gralloc_driver()
 {
-	buffers_.clear();
-	handles_.clear();
+	{
+		std::lock_guard<std::mutex> lock(preallocation_mutex_);
+		preallocation_stop_ = true;
+	}
+	preallocation_cv_.notify_all();
+	if (preallocation_refiller_.joinable())
+		preallocation_refiller_.join();
+	drain_preallocation_pool();
+
+	{
+		std::lock_guard<std::mutex> lock(import_cache_mutex_);
+		import_cache_stop_ = true;
+	}
+	import_cache_cv_.notify_all();
+	if (import_cache_reaper_.joinable())
+		import_cache_reaper_.join();
+	import_cache_.clear();
+
+	for (auto &shard : handle_shards_) {
+		for (auto &bucket : shard.buckets) {
+			handle_node *node = bucket.exchange(nullptr);
+			while (node) {
+				handle_node *next = node->next.load();
+				delete node;
+				node = next;
+			}
+		}
+		shard.handles.clear();
+	}
+	for (auto &shard : buffer_shards_)
+		shard.buffers.clear();
+
+	if (reserved_arena_fd_ >= 0)
+		close(reserved_arena_fd_);
 }
 
 bool cros_gralloc_driver::is_initialized()
@@ -183,9 +241,79 @@ bool cros_gralloc_driver::is_initialized()
 	return drv_ != nullptr;
 }
 
+bool cros_gralloc_driver::resolved_format_key::operator==(const resolved_format_key &other) const
+{
+	return width == other.width && height == other.height &&
+	       droid_format == other.droid_format && droid_usage == other.droid_usage &&
+	       drm_format == other.drm_format && use_flags == other.use_flags;
+}
+
+size_t
+cros_gralloc_driver::resolved_format_key_hash::operator()(const resolved_format_key &key) const
+{
+	uint64_t hash = key.drm_format;
+
+	hash = hash * 31 + key.use_flags;
+	hash = hash * 31 + static_cast<uint64_t>(key.droid_usage);
+	hash = hash * 31 + static_cast<uint32_t>(key.droid_format);
+	hash = hash * 31 + ((static_cast<uint64_t>(key.width) << 32) | key.height);
+
+	return std::hash<uint64_t>()(hash);
+}
+
+/* Per shard; a full shard starts over rather than tracking which entries are still used. */
+static constexpr size_t kMaxResolvedFormatsPerShard = 64;
+
 bool cros_gralloc_driver::get_resolved_format_and_use_flags(
     const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t *out_format,
     uint64_t *out_use_flags)
+{
+	const resolved_format_key key = {
+		.width = descriptor->width,
+		.height = descriptor->height,
+		.droid_format = descriptor->droid_format,
+		.droid_usage = descriptor->droid_usage,
+		.drm_format = descriptor->drm_format,
+		.use_flags = descriptor->use_flags,
+	};
+	auto &shard = resolved_format_shards_[resolved_format_key_hash()(key) % kNumShards];
+
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.entries.find(key);
+		if (it != shard.entries.end()) {
+			*out_format = it->second.format;
+			*out_use_flags = it->second.use_flags;
+			return it->second.supported;
+		}
+	}
+
+	// Resolve without the lock, racing threads just store the same result.
+	resolved_format resolved = {};
+	int32_t ret =
+	    resolve_format_and_use_flags(descriptor, &resolved.format, &resolved.use_flags);
+	if (ret && ret != -ENOTSUP)
+		return false;
+
+	resolved.supported = !ret;
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (shard.entries.size() >= kMaxResolvedFormatsPerShard)
+		shard.entries.clear();
+	shard.entries.emplace(key, resolved);
+
+	*out_format = resolved.format;
+	*out_use_flags = resolved.use_flags;
+	return resolved.supported;
+}
+
+/*
+ * Returns 0 on success, -ENOTSUP when the descriptor is not supported, or another negative errno
+ * when the test allocation failed for some other reason.
+ */
+int32_t cros_gralloc_driver::resolve_format_and_use_flags(
+    const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t *out_format,
+    uint64_t *out_use_flags)
 {
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
@@ -200,11 +328,11 @@ bool cros_gralloc_driver::get_resolved_format_and_use_flags(
 	if (ret == 0) {
 		*out_format = resolved_format;
 		*out_use_flags = resolved_use_flags;
-		return true;
+		return 0;
 	}
 
 	if (ret != -ENOTSUP)
-		return false;
+		return ret;
 
 	combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
 	if (!combo && (descriptor->droid_usage & GRALLOC_USAGE_HW_VIDEO_ENCODER) &&
@@ -222,11 +350,11 @@ bool cros_gralloc_driver::get_resolved_format_and_use_flags(
 		combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
 	}
 	if (!combo)
-		return false;
+		return -ENOTSUP;
 
 	*out_format = resolved_format;
 	*out_use_flags = resolved_use_flags;
-	return true;
+	return 0;
 }
 
 bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descriptor *descriptor)
@@ -244,8 +372,13 @@ bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descript
 	return descriptor->width <= max_texture_size && descriptor->height <= max_texture_size;
 }
 
-int cros_gralloc_driver::create_reserved_region(const std::string &buffer_name,
-						uint64_t reserved_region_size)
+/* Reserved region arenas; regions are rounded up to whole slots. */
+static constexpr uint64_t kReservedArenaSize = 64 * 1024;
+static constexpr uint64_t kReservedArenaSlotSize = 256;
+static constexpr uint64_t kReservedArenaMaxRegionSize = 4096;
+
+int cros_gralloc_driver::create_reserved_region_fd(const std::string &buffer_name,
+						   uint64_t reserved_region_size)
 {
 	int ret;
 
@@ -265,8 +398,56 @@ int cros_gralloc_driver::create_reserved_region(const std::string &buffer_name,
 	return -1;
 }
 
-int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
-				      native_handle_t **out_handle)
+int cros_gralloc_driver::alloc_reserved_arena_slot(uint64_t reserved_region_size,
+						   uint64_t *reserved_region_offset)
+{
+	uint64_t slot_size = ALIGN(reserved_region_size, kReservedArenaSlotSize);
+	std::lock_guard<std::mutex> lock(reserved_arena_mutex_);
+
+	if (reserved_arena_fd_ < 0 || reserved_arena_offset_ + slot_size > kReservedArenaSize) {
+		/* Handles into the old arena hold their own fd, which keeps it alive. */
+		if (reserved_arena_fd_ >= 0)
+			close(reserved_arena_fd_);
+
+		reserved_arena_fd_ = create_reserved_region_fd("arena", kReservedArenaSize);
+		reserved_arena_offset_ = 0;
+		if (reserved_arena_fd_ < 0)
+			return -1;
+	}
+
+	int fd = fcntl(reserved_arena_fd_, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		ALOGE("Failed to dup reserved region arena: %s.", strerror(errno));
+		return -1;
+	}
+
+	*reserved_region_offset = reserved_arena_offset_;
+	reserved_arena_offset_ += slot_size;
+	return fd;
+}
+
+int cros_gralloc_driver::create_reserved_region(const std::string &buffer_name,
+						uint64_t reserved_region_size,
+						uint64_t *reserved_region_offset)
+{
+	if (use_reserved_arena_ && reserved_region_size <= kReservedArenaMaxRegionSize) {
+		int ret = alloc_reserved_arena_slot(reserved_region_size, reserved_region_offset);
+		if (ret >= 0)
+			return ret;
+	}
+
+	*reserved_region_offset = 0;
+	return create_reserved_region_fd(buffer_name, reserved_region_size);
+}
+
+/* What check_memory_budget() may empty to stay within the soft budget. */
+static constexpr uint32_t kShrinkImportCache = 1 << 0;
+static constexpr uint32_t kShrinkPreallocationPool = 1 << 1;
+/* Skips the check for buffers that count against whoever imports them. */
+static constexpr uint32_t kBudgetUnchecked = 1 << 2;
+
+int32_t cros_gralloc_driver::allocate_buffer(const struct cros_gralloc_buffer_descriptor *descriptor,
+					     native_handle_t **out_handle, uint32_t budget_shrink)
 {
 	int ret = 0;
 	size_t num_planes;
@@ -290,6 +471,13 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 		return ret;
 	}
 
+	ret = check_memory_budget(descriptor->reserved_region_size + drv_bo_get_total_size(bo),
+				  budget_shrink);
+	if (ret) {
+		drv_bo_destroy(bo);
+		return ret;
+	}
+
 	num_planes = drv_bo_get_num_planes(bo);
 	num_fds = num_planes;
 
@@ -318,12 +506,17 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	}
 
 	hnd->reserved_region_size = descriptor->reserved_region_size;
+	hnd->reserved_region_offset = 0;
 	if (hnd->reserved_region_size > 0) {
-		ret = create_reserved_region(descriptor->name, hnd->reserved_region_size);
+		uint64_t reserved_region_offset;
+
+		ret = create_reserved_region(descriptor->name, hnd->reserved_region_size,
+					     &reserved_region_offset);
 		if (ret < 0)
 			goto destroy_hnd;
 
 		hnd->fds[hnd->num_planes] = ret;
+		hnd->reserved_region_offset = reserved_region_offset;
 	}
 
 	static std::atomic<uint32_t> next_buffer_id{ 1 };
@@ -340,7 +533,7 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->usage = descriptor->droid_usage;
 	hnd->total_size = descriptor->reserved_region_size + drv_bo_get_total_size(bo);
 
-	buffer = cros_gralloc_buffer::create(bo, hnd);
+	buffer = cros_gralloc_buffer::create(bo, hnd, /*import_inode=*/0);
 	if (!buffer) {
 		ALOGE("Failed to allocate: failed to create cros_gralloc_buffer.");
 		ret = -1;
@@ -348,14 +541,21 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	}
 
 	{
-		std::lock_guard<std::mutex> lock(mutex_);
+		uint32_t id = hnd->id;
+		std::shared_ptr<cros_gralloc_buffer> shared_buffer(std::move(buffer));
+		auto &handle_shard = get_handle_shard(hnd);
+		auto &buffer_shard = get_buffer_shard(id);
+		std::lock_guard<std::mutex> handle_lock(handle_shard.mutex);
+		std::lock_guard<std::mutex> buffer_lock(buffer_shard.mutex);
 
 		struct cros_gralloc_imported_handle_info hnd_info = {
-			.buffer = buffer.get(),
+			.buffer = shared_buffer,
 			.refcount = 1,
 		};
-		handles_.emplace(hnd, hnd_info);
-		buffers_.emplace(hnd->id, std::move(buffer));
+		handle_shard.handles.emplace(hnd, hnd_info);
+		publish_handle(handle_shard, hnd, shared_buffer);
+		account_buffer(shared_buffer.get(), true);
+		buffer_shard.buffers.emplace(id, std::move(shared_buffer));
 	}
 
 	*out_handle = hnd;
@@ -369,18 +569,287 @@ destroy_hnd:
 	return ret;
 }
 
-int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
+/* Preallocation pool tuning, see cros_gralloc_driver.h. */
+static constexpr auto kPreallocationTick = std::chrono::seconds(10);
+static constexpr size_t kPreallocationMaxShapes = 16;
+static constexpr size_t kPreallocationMaxHotShapes = 4;
+static constexpr uint32_t kPreallocationHotScore = 4;
+static constexpr uint32_t kPreallocationMaxScore = 64;
+static constexpr size_t kPreallocationDepth = 2;
+static constexpr uint64_t kPreallocationMaxBytes = 64 * 1024 * 1024;
+/* Allocations between two reports of the pool hit rate and latencies. */
+static constexpr uint64_t kPreallocationReportInterval = 256;
+
+static bool same_shape(const struct cros_gralloc_buffer_descriptor *a,
+		       const struct cros_gralloc_buffer_descriptor *b)
+{
+	return a->width == b->width && a->height == b->height &&
+	       a->droid_format == b->droid_format && a->droid_usage == b->droid_usage &&
+	       a->drm_format == b->drm_format && a->use_flags == b->use_flags &&
+	       a->reserved_region_size == b->reserved_region_size;
+}
+
+static uint64_t get_handle_size(const native_handle_t *handle)
+{
+	return cros_gralloc_convert_handle(handle)->total_size;
+}
+
+/* Whether less than a tenth of the memory is available, going by /proc/meminfo. */
+static bool under_memory_pressure()
+{
+	uint64_t total = 0;
+	uint64_t available = 0;
+	char line[128];
+
+	FILE *file = fopen("/proc/meminfo", "re");
+	if (!file)
+		return false;
+
+	while (fgets(line, sizeof(line), file)) {
+		unsigned long long value;
+
+		if (sscanf(line, "MemTotal: %llu kB", &value) == 1)
+			total = value;
+		else if (sscanf(line, "MemAvailable: %llu kB", &value) == 1)
+			available = value;
+	}
+	fclose(file);
+
+	return total && available < total / 10;
+}
+
+void cros_gralloc_driver::enable_preallocation()
+{
+	if (property_get_bool("ro.config.low_ram", false) ||
+	    !property_get_bool("ro.vendor.minigbm.preallocation", false))
+		return;
+
+	std::lock_guard<std::mutex> lock(preallocation_mutex_);
+	if (!preallocation_refiller_.joinable())
+		preallocation_refiller_ =
+		    std::thread(&cros_gralloc_driver::preallocation_refiller, this);
+	preallocation_enabled_ = true;
+}
+
+void cros_gralloc_driver::set_allocator_service()
+{
+	allocator_service_ = true;
+}
+
+int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+				      native_handle_t **out_handle)
+{
+	const uint32_t shrink = allocator_service_ ? kBudgetUnchecked
+						   : kShrinkImportCache | kShrinkPreallocationPool;
+
+	if (!preallocation_enabled_)
+		return allocate_buffer(descriptor, out_handle, shrink);
+
+	auto start = std::chrono::steady_clock::now();
+	if (take_preallocated(descriptor, out_handle)) {
+		record_allocate_latency(true, std::chrono::steady_clock::now() - start);
+		return 0;
+	}
+
+	int32_t ret = allocate_buffer(descriptor, out_handle, shrink);
+	// The pooled buffers may be what is keeping this allocation from succeeding.
+	if (ret && ret != -EINVAL && drain_preallocation_pool())
+		ret = allocate_buffer(descriptor, out_handle, shrink);
+	if (!ret)
+		record_allocate_latency(false, std::chrono::steady_clock::now() - start);
+
+	return ret;
+}
+
+bool cros_gralloc_driver::take_preallocated(const struct cros_gralloc_buffer_descriptor *descriptor,
+					    native_handle_t **out_handle)
+{
+	std::lock_guard<std::mutex> lock(preallocation_mutex_);
+
+	auto it = preallocation_shapes_.begin();
+	while (it != preallocation_shapes_.end() && !same_shape(&it->descriptor, descriptor))
+		++it;
+
+	if (it == preallocation_shapes_.end()) {
+		// A full table only takes new shapes once older ones have cooled down.
+		if (preallocation_shapes_.size() < kPreallocationMaxShapes) {
+			// Pooled buffers go to whoever asks next, so their reserved region memfds
+			// can't carry the name of the request that made the shape hot.
+			preallocation_shapes_.push_back({ *descriptor, 1, {} });
+			preallocation_shapes_.back().descriptor.name = "preallocated";
+		}
+		return false;
+	}
+
+	it->score = std::min(it->score + 1, kPreallocationMaxScore);
+
+	bool hit = !it->ready.empty();
+	if (hit) {
+		*out_handle = it->ready.back();
+		it->ready.pop_back();
+		preallocation_bytes_ -= get_handle_size(*out_handle);
+	}
+
+	if (it->score >= kPreallocationHotScore) {
+		preallocation_refill_ = true;
+		preallocation_cv_.notify_one();
+	}
+
+	return hit;
+}
+
+void cros_gralloc_driver::record_allocate_latency(bool hit,
+						  std::chrono::steady_clock::duration latency)
+{
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+
+	std::lock_guard<std::mutex> lock(preallocation_mutex_);
+	auto &stats = preallocation_stats_;
+	if (hit) {
+		stats.hits++;
+		stats.hit_ns += ns;
+	} else {
+		stats.misses++;
+		stats.miss_ns += ns;
+	}
+
+	if ((stats.hits + stats.misses) % kPreallocationReportInterval)
+		return;
+
+	ALOGI("Preallocation: %llu hits (%llu us on average), %llu misses (%llu us on average).",
+	      (unsigned long long)stats.hits,
+	      (unsigned long long)(stats.hits ? stats.hit_ns / stats.hits / 1000 : 0),
+	      (unsigned long long)stats.misses,
+	      (unsigned long long)(stats.misses ? stats.miss_ns / stats.misses / 1000 : 0));
+}
+
+cros_gralloc_driver::preallocation_stats cros_gralloc_driver::get_preallocation_stats()
+{
+	std::lock_guard<std::mutex> lock(preallocation_mutex_);
+	return preallocation_stats_;
+}
+
+void cros_gralloc_driver::free_preallocated(native_handle_t *handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	release(handle);
+	native_handle_close(handle);
+	native_handle_delete(handle);
+}
+
+bool cros_gralloc_driver::drain_preallocation_pool()
+{
+	std::vector<native_handle_t *> handles;
+	{
+		std::lock_guard<std::mutex> lock(preallocation_mutex_);
+		for (auto &shape : preallocation_shapes_) {
+			handles.insert(handles.end(), shape.ready.begin(), shape.ready.end());
+			shape.ready.clear();
+		}
+		preallocation_bytes_ = 0;
+	}
+
+	for (auto handle : handles)
+		free_preallocated(handle);
+
+	return !handles.empty();
+}
+
+void cros_gralloc_driver::preallocation_refiller()
+{
+	// Only ever use what the binder threads leave over.
+	setpriority(PRIO_PROCESS, syscall(__NR_gettid), 19);
+
+	auto next_tick = std::chrono::steady_clock::now() + kPreallocationTick;
+	std::unique_lock<std::mutex> lock(preallocation_mutex_);
+
+	while (!preallocation_stop_) {
+		preallocation_cv_.wait_until(lock, next_tick, [this] {
+			return preallocation_stop_ || preallocation_refill_;
+		});
+		if (preallocation_stop_)
+			break;
+		preallocation_refill_ = false;
+
+		std::vector<native_handle_t *> freed;
+		auto drop_ready = [&](preallocation_shape &shape) {
+			for (auto handle : shape.ready) {
+				preallocation_bytes_ -= get_handle_size(handle);
+				freed.push_back(handle);
+			}
+			shape.ready.clear();
+		};
+
+		if (std::chrono::steady_clock::now() >= next_tick) {
+			next_tick = std::chrono::steady_clock::now() + kPreallocationTick;
+			for (auto it = preallocation_shapes_.begin(); it != preallocation_shapes_.end();) {
+				it->score /= 2;
+				if (it->score < kPreallocationHotScore)
+					drop_ready(*it);
+				if (!it->score)
+					it = preallocation_shapes_.erase(it);
+				else
+					++it;
+			}
+		}
+
+		if (under_memory_pressure()) {
+			for (auto &shape : preallocation_shapes_)
+				drop_ready(shape);
+		} else {
+			std::vector<std::list<preallocation_shape>::iterator> hot;
+			for (auto it = preallocation_shapes_.begin(); it != preallocation_shapes_.end();
+			     ++it) {
+				if (it->score >= kPreallocationHotScore)
+					hot.push_back(it);
+			}
+			std::sort(hot.begin(), hot.end(), [](const auto &a, const auto &b) {
+				return a->score > b->score;
+			});
+			if (hot.size() > kPreallocationMaxHotShapes)
+				hot.resize(kPreallocationMaxHotShapes);
+
+			for (auto it : hot) {
+				while (!preallocation_stop_ && it->ready.size() < kPreallocationDepth &&
+				       preallocation_bytes_ < kPreallocationMaxBytes) {
+					struct cros_gralloc_buffer_descriptor descriptor = it->descriptor;
+					native_handle_t *handle;
+
+					// Never shrink anything to make room for the pool.
+					lock.unlock();
+					int32_t ret = allocate_buffer(&descriptor, &handle, 0);
+					lock.lock();
+					if (ret)
+						break;
+
+					it->ready.push_back(handle);
+					preallocation_bytes_ += get_handle_size(handle);
+				}
+			}
+		}
+
+		lock.unlock();
+		for (auto handle : freed)
+			free_preallocated(handle);
+		lock.lock();
+	}
+}
 
+int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
+{
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
 		return -EINVAL;
 	}
 
-	auto hnd_it = handles_.find(hnd);
-	if (hnd_it != handles_.end()) {
+	uint32_t id = hnd->id;
+	auto &handle_shard = get_handle_shard(hnd);
+	auto &buffer_shard = get_buffer_shard(id);
+	std::lock_guard<std::mutex> handle_lock(handle_shard.mutex);
+	std::lock_guard<std::mutex> buffer_lock(buffer_shard.mutex);
+
+	auto hnd_it = handle_shard.handles.find(hnd);
+	if (hnd_it != handle_shard.handles.end()) {
 		// The underlying buffer (as multiple handles can refer to the same buffer)
 		// has already been imported into this process and the given handle has
 		// already been registered in this process. Increase both the buffer and
@@ -393,21 +862,32 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		return 0;
 	}
 
-	uint32_t id = hnd->id;
-
-	cros_gralloc_buffer *buffer = nullptr;
+	std::shared_ptr<cros_gralloc_buffer> buffer;
+	ino_t inode = get_fd_inode(hnd->fds[0]);
 
-	auto buffer_it = buffers_.find(id);
-	if (buffer_it != buffers_.end()) {
+	auto buffer_it = buffer_shard.buffers.find(id);
+	if (buffer_it != buffer_shard.buffers.end()) {
 		// The underlying buffer (as multiple handles can refer to the same buffer)
 		// has already been imported into this process but the given handle has not
 		// yet been registered. Increase the buffer reference count (here) and start
 		// to track the handle (below).
-		buffer = buffer_it->second.get();
+		buffer = buffer_it->second;
+		buffer->increase_refcount();
+	} else if (inode && (buffer = take_cached_import(id, inode))) {
+		// The underlying buffer was released by this process only moments ago and is
+		// still in the import cache. Revive it (here) and start to track the handle
+		// (below).
 		buffer->increase_refcount();
+		account_buffer(buffer.get(), true);
+		buffer_shard.buffers.emplace(id, buffer);
 	} else {
 		// The underlying buffer has not yet been imported into this process. Import
 		// and start to track the buffer (here) and start to track the handle (below).
+		// The preallocation pool can't be drained with the shard locks held.
+		int32_t ret = check_memory_budget(hnd->total_size, kShrinkImportCache);
+		if (ret)
+			return ret;
+
 		struct drv_import_fd_data data = {
 			.format_modifier = hnd->format_modifier,
 			.width = hnd->width,
@@ -421,81 +901,387 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		memcpy(data.offsets, hnd->offsets, sizeof(data.offsets));
 
 		struct bo *bo = drv_bo_import(drv_.get(), &data);
+		// The cached buffers may be what is holding the process at its fd or memory limit.
+		if (!bo && flush_import_cache())
+			bo = drv_bo_import(drv_.get(), &data);
 		if (!bo)
 			return -EFAULT;
 
-		auto scoped_buffer = cros_gralloc_buffer::create(bo, hnd);
+		auto scoped_buffer = cros_gralloc_buffer::create(bo, hnd, inode);
 		if (!scoped_buffer) {
 			ALOGE("Failed to import: failed to create cros_gralloc_buffer.");
 			return -1;
 		}
-		buffer = scoped_buffer.get();
-		buffers_.emplace(id, std::move(scoped_buffer));
+		buffer = std::move(scoped_buffer);
+		account_buffer(buffer.get(), true);
+		buffer_shard.buffers.emplace(id, buffer);
 	}
 
 	struct cros_gralloc_imported_handle_info hnd_info = {
-		.buffer = buffer,
+		.buffer = std::move(buffer),
 		.refcount = 1,
 	};
-	handles_.emplace(hnd, hnd_info);
+	handle_shard.handles.emplace(hnd, hnd_info);
+	publish_handle(handle_shard, hnd, hnd_info.buffer);
 	return 0;
 }
 
 int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
 		return -EINVAL;
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
+	auto &handle_shard = get_handle_shard(hnd);
+	std::lock_guard<std::mutex> handle_lock(handle_shard.mutex);
+
+	auto hnd_it = handle_shard.handles.find(hnd);
+	if (hnd_it == handle_shard.handles.end()) {
 		ALOGE("Invalid reference (release() called on unregistered handle).");
 		return -EINVAL;
 	}
 
-	if (!--handles_[hnd].refcount)
-		handles_.erase(hnd);
+	// Keep the buffer alive until its refcount is dropped below.
+	auto buffer = hnd_it->second.buffer;
+	if (!--hnd_it->second.refcount) {
+		handle_shard.handles.erase(hnd_it);
+		retire_handle(handle_shard, hnd);
+	}
 
+	auto &buffer_shard = get_buffer_shard(buffer->get_id());
+	std::lock_guard<std::mutex> buffer_lock(buffer_shard.mutex);
 	if (buffer->decrease_refcount() == 0) {
-		buffers_.erase(buffer->get_id());
+		buffer_shard.buffers.erase(buffer->get_id());
+		account_buffer(buffer.get(), false);
+		if (buffer->get_import_inode())
+			cache_import(std::move(buffer));
 	}
 
 	return 0;
 }
 
+static enum cros_gralloc_driver::memory_category get_memory_category(uint64_t use_flags)
+{
+	if (use_flags & BO_USE_PROTECTED)
+		return cros_gralloc_driver::kMemoryProtected;
+	if (use_flags & (BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE))
+		return cros_gralloc_driver::kMemoryCamera;
+	if (use_flags & (BO_USE_HW_VIDEO_DECODER | BO_USE_HW_VIDEO_ENCODER))
+		return cros_gralloc_driver::kMemoryVideo;
+	if (use_flags & (BO_USE_SCANOUT | BO_USE_CURSOR | BO_USE_FRONT_RENDERING))
+		return cros_gralloc_driver::kMemoryScanout;
+	if (use_flags & (BO_USE_RENDERING | BO_USE_TEXTURE | BO_USE_GPU_DATA_BUFFER |
+			 BO_USE_RENDERSCRIPT))
+		return cros_gralloc_driver::kMemoryGpu;
+	if (use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_OFTEN |
+			 BO_USE_SW_WRITE_RARELY))
+		return cros_gralloc_driver::kMemoryCpu;
+
+	return cros_gralloc_driver::kMemoryOther;
+}
+
+static const char *get_memory_category_name(uint32_t category)
+{
+	static const char *const names[cros_gralloc_driver::kNumMemoryCategories] = {
+		"protected", "camera", "video", "scanout", "gpu", "cpu", "other",
+	};
+
+	return names[category];
+}
+
+void cros_gralloc_driver::account_buffer(const cros_gralloc_buffer *buffer, bool add)
+{
+	uint64_t size = buffer->get_total_size();
+	uint64_t reserved_region_size = buffer->get_reserved_region_size();
+	auto &stats = memory_stats_;
+
+	std::lock_guard<std::mutex> lock(memory_mutex_);
+	if (add) {
+		stats.num_buffers++;
+		stats.total_bytes += size;
+		stats.category_bytes[get_memory_category(buffer->get_use_flags())] += size;
+		stats.device_bytes += size - reserved_region_size;
+		stats.reserved_region_bytes += reserved_region_size;
+		stats.format_bytes[buffer->get_format()] += size;
+	} else {
+		stats.num_buffers--;
+		stats.total_bytes -= size;
+		stats.category_bytes[get_memory_category(buffer->get_use_flags())] -= size;
+		stats.device_bytes -= size - reserved_region_size;
+		stats.reserved_region_bytes -= reserved_region_size;
+		auto it = stats.format_bytes.find(buffer->get_format());
+		if (!(it->second -= size))
+			stats.format_bytes.erase(it);
+	}
+}
+
+uint64_t cros_gralloc_driver::get_budgeted_bytes()
+{
+	uint64_t bytes;
+	{
+		std::lock_guard<std::mutex> lock(memory_mutex_);
+		bytes = memory_stats_.total_bytes;
+	}
+
+	std::lock_guard<std::mutex> lock(import_cache_mutex_);
+	return bytes + import_cache_bytes_;
+}
+
+int32_t cros_gralloc_driver::check_memory_budget(uint64_t size, uint32_t shrink)
+{
+	if (shrink & kBudgetUnchecked)
+		return 0;
+
+	uint64_t soft_budget = memory_soft_budget_ ? memory_soft_budget_ : memory_hard_budget_;
+
+	if (!soft_budget || get_budgeted_bytes() + size <= soft_budget)
+		return 0;
+
+	// Without anything to shrink, stay within the soft budget.
+	if (!shrink)
+		return -ENOMEM;
+
+	if (shrink & kShrinkImportCache)
+		flush_import_cache();
+	if (shrink & kShrinkPreallocationPool)
+		drain_preallocation_pool();
+
+	uint64_t used = get_budgeted_bytes();
+	if (!memory_hard_budget_ || used + size <= memory_hard_budget_)
+		return 0;
+
+	ALOGE("Failed to allocate %llu bytes: %llu of the %llu byte hard memory budget are in use.",
+	      (unsigned long long)size, (unsigned long long)used,
+	      (unsigned long long)memory_hard_budget_);
+	return -ENOMEM;
+}
+
+cros_gralloc_driver::memory_stats cros_gralloc_driver::get_memory_stats()
+{
+	memory_stats stats;
+	{
+		std::lock_guard<std::mutex> lock(memory_mutex_);
+		stats = memory_stats_;
+	}
+	{
+		std::lock_guard<std::mutex> lock(preallocation_mutex_);
+		stats.preallocated_bytes = preallocation_bytes_;
+	}
+	{
+		std::lock_guard<std::mutex> lock(import_cache_mutex_);
+		stats.import_cache_bytes = import_cache_bytes_;
+	}
+	stats.soft_budget = memory_soft_budget_;
+	stats.hard_budget = memory_hard_budget_;
+
+	return stats;
+}
+
+cros_gralloc_driver::memory_usage cros_gralloc_driver::get_memory_usage()
+{
+	memory_usage usage;
+	{
+		std::lock_guard<std::mutex> lock(memory_mutex_);
+		usage.num_buffers = memory_stats_.num_buffers;
+	}
+	usage.budgeted_bytes = get_budgeted_bytes();
+	usage.soft_budget = memory_soft_budget_;
+	usage.hard_budget = memory_hard_budget_;
+
+	return usage;
+}
+
+static std::string format_bytes(uint64_t bytes)
+{
+	char str[32];
+
+	snprintf(str, sizeof(str), "%.1f MiB", bytes / (1024.0 * 1024.0));
+	return str;
+}
+
+std::string cros_gralloc_driver::dump_memory_stats()
+{
+	auto stats = get_memory_stats();
+
+	std::string dump = "gralloc memory: " + std::to_string(stats.num_buffers) + " buffers, " +
+			   format_bytes(stats.total_bytes) + ", budgets " +
+			   (stats.soft_budget ? format_bytes(stats.soft_budget) : "none") + " soft, " +
+			   (stats.hard_budget ? format_bytes(stats.hard_budget) : "none") + " hard\n";
+
+	dump += "  by usage:";
+	for (uint32_t category = 0; category < kNumMemoryCategories; category++) {
+		if (stats.category_bytes[category])
+			dump += std::string(" ") + get_memory_category_name(category) + " " +
+				format_bytes(stats.category_bytes[category]);
+	}
+
+	dump += "\n  by heap: device " + format_bytes(stats.device_bytes) + ", reserved region " +
+		format_bytes(stats.reserved_region_bytes) + "\n";
+
+	dump += "  by format:";
+	for (const auto &pair : stats.format_bytes)
+		dump += " " + get_drm_format_string(pair.first) + " " + format_bytes(pair.second);
+
+	dump += "\n  preallocated " + format_bytes(stats.preallocated_bytes) + ", import cache " +
+		format_bytes(stats.import_cache_bytes) + "\n";
+
+	return dump;
+}
+
+static constexpr auto kImportCacheGracePeriod = std::chrono::milliseconds(1000);
+static constexpr size_t kImportCacheMaxEntries = 32;
+static constexpr uint64_t kImportCacheMaxBytes = 64 * 1024 * 1024;
+/* Lookups between two reports of the import cache hit rate. */
+static constexpr uint64_t kImportCacheReportInterval = 1024;
+
+std::shared_ptr<cros_gralloc_buffer> cros_gralloc_driver::take_cached_import(uint32_t id,
+									      ino_t inode)
+{
+	std::lock_guard<std::mutex> lock(import_cache_mutex_);
+
+	// Buffer ids are only unique per allocator process, the inode tells re-used ids apart.
+	for (auto it = import_cache_.begin(); it != import_cache_.end(); ++it) {
+		if (it->id != id || it->inode != inode)
+			continue;
+
+		auto buffer = std::move(it->buffer);
+		import_cache_bytes_ -= buffer->get_total_size();
+		import_cache_fds_ -= buffer->get_num_fds();
+		import_cache_.erase(it);
+		import_cache_stats_.hits++;
+		return buffer;
+	}
+
+	import_cache_stats_.misses++;
+	return nullptr;
+}
+
+void cros_gralloc_driver::cache_import(std::shared_ptr<cros_gralloc_buffer> buffer)
+{
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> evicted;
+	{
+		std::lock_guard<std::mutex> lock(import_cache_mutex_);
+		if (import_cache_stop_)
+			return;
+
+		import_cache_bytes_ += buffer->get_total_size();
+		import_cache_fds_ += buffer->get_num_fds();
+		import_cache_.push_back({
+		    .buffer = buffer,
+		    .id = buffer->get_id(),
+		    .inode = buffer->get_import_inode(),
+		    .expiry = std::chrono::steady_clock::now() + kImportCacheGracePeriod,
+		});
+		evict_imports(/*all=*/false, &evicted);
+
+		if (!import_cache_reaper_.joinable())
+			import_cache_reaper_ = std::thread(&cros_gralloc_driver::import_cache_reaper, this);
+		else if (import_cache_.size() == 1)
+			import_cache_cv_.notify_one();
+	}
+
+	// Destroy the evicted buffers without blocking other lookups.
+	evicted.clear();
+}
+
+void cros_gralloc_driver::evict_imports(bool all,
+					std::vector<std::shared_ptr<cros_gralloc_buffer>> *evicted)
+{
+	auto now = std::chrono::steady_clock::now();
+
+	while (!import_cache_.empty()) {
+		auto &entry = import_cache_.front();
+		if (!all && entry.expiry > now && import_cache_.size() <= kImportCacheMaxEntries &&
+		    import_cache_bytes_ <= kImportCacheMaxBytes &&
+		    import_cache_fds_ <= import_cache_max_fds_)
+			break;
+
+		import_cache_bytes_ -= entry.buffer->get_total_size();
+		import_cache_fds_ -= entry.buffer->get_num_fds();
+		evicted->push_back(std::move(entry.buffer));
+		import_cache_.pop_front();
+		import_cache_stats_.evictions++;
+	}
+
+	uint64_t lookups = import_cache_stats_.hits + import_cache_stats_.misses;
+	if (import_cache_.empty() &&
+	    lookups - import_cache_reported_lookups_ >= kImportCacheReportInterval) {
+		ALOGI("Import cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions.",
+		      (unsigned long long)import_cache_stats_.hits,
+		      (unsigned long long)import_cache_stats_.misses,
+		      100.0 * import_cache_stats_.hits / lookups,
+		      (unsigned long long)import_cache_stats_.evictions);
+		import_cache_reported_lookups_ = lookups;
+	}
+}
+
+bool cros_gralloc_driver::flush_import_cache()
+{
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> evicted;
+	{
+		std::lock_guard<std::mutex> lock(import_cache_mutex_);
+		evict_imports(/*all=*/true, &evicted);
+	}
+
+	return !evicted.empty();
+}
+
+void cros_gralloc_driver::import_cache_reaper()
+{
+	std::unique_lock<std::mutex> lock(import_cache_mutex_);
+
+	while (!import_cache_stop_) {
+		if (import_cache_.empty()) {
+			import_cache_cv_.wait(lock);
+			continue;
+		}
+
+		auto expiry = import_cache_.front().expiry;
+		if (import_cache_cv_.wait_until(lock, expiry) == std::cv_status::no_timeout)
+			continue;
+
+		std::vector<std::shared_ptr<cros_gralloc_buffer>> evicted;
+		evict_imports(/*all=*/false, &evicted);
+		lock.unlock();
+		evicted.clear();
+		lock.lock();
+	}
+}
+
+cros_gralloc_driver::import_cache_stats cros_gralloc_driver::get_import_cache_stats()
+{
+	std::lock_guard<std::mutex> lock(import_cache_mutex_);
+	return import_cache_stats_;
+}
+
 int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 				  bool close_acquire_fence, const struct rectangle *rect,
 				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
 {
-	int32_t ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
-	if (ret)
-		return ret;
-
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
 		ALOGE("Invalid reference (lock() called on unregistered handle).");
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
-	return buffer->lock(rect, map_flags, addr);
+	/* The buffer waits for the fence itself so that mapping setup can overlap with it. */
+	return buffer->lock(rect, map_flags, acquire_fence, close_acquire_fence, addr);
 }
 
 int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -513,15 +1299,14 @@ int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fen
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * Backends that can flush asynchronously return a fence for the pending write-back.
 	 */
-	*release_fence = -1;
-	return buffer->unlock();
+	return buffer->unlock(release_fence);
 }
 
 int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -539,8 +1324,6 @@ int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::flush(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -558,8 +1341,6 @@ int32_t cros_gralloc_driver::flush(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -580,8 +1361,6 @@ int32_t cros_gralloc_driver::resource_info(buffer_handle_t handle, uint32_t stri
 					   uint32_t offsets[DRV_MAX_PLANES],
 					   uint64_t *format_modifier)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -601,8 +1380,6 @@ int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
 						 void **reserved_region_addr,
 						 uint64_t *reserved_region_size)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -629,34 +1406,112 @@ uint32_t cros_gralloc_driver::get_resolved_drm_format(uint32_t drm_format, uint6
 	return resolved_format;
 }
 
-cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+cros_gralloc_driver::handle_shard &
+cros_gralloc_driver::get_handle_shard(cros_gralloc_handle_t hnd)
+{
+	/* Handles are heap allocated, so the low bits carry no information. */
+	return handle_shards_[(reinterpret_cast<uintptr_t>(hnd) >> 4) % kNumShards];
+}
+
+cros_gralloc_driver::buffer_shard &cros_gralloc_driver::get_buffer_shard(uint32_t id)
 {
-	/* Assumes driver mutex is held. */
-	if (handles_.count(hnd))
-		return handles_[hnd].buffer;
+	/* Buffer ids are handed out sequentially. */
+	return buffer_shards_[id % kNumShards];
+}
 
-	return nullptr;
+std::atomic<cros_gralloc_driver::handle_node *> &
+cros_gralloc_driver::get_handle_bucket(handle_shard &shard, cros_gralloc_handle_t hnd)
+{
+	/* The low bits past the alignment already picked the shard. */
+	return shard.buckets[(reinterpret_cast<uintptr_t>(hnd) >> 4) / kNumShards % kHandleBuckets];
+}
+
+void cros_gralloc_driver::publish_handle(handle_shard &shard, cros_gralloc_handle_t hnd,
+					 const std::shared_ptr<cros_gralloc_buffer> &buffer)
+{
+	/* Assumes the shard mutex is held. */
+	auto &bucket = get_handle_bucket(shard, hnd);
+	auto node = new handle_node();
+	node->hnd = hnd;
+	node->buffer = buffer;
+	node->next.store(bucket.load());
+	bucket.store(node);
+}
+
+void cros_gralloc_driver::retire_handle(handle_shard &shard, cros_gralloc_handle_t hnd)
+{
+	/* Assumes the shard mutex is held. */
+	std::atomic<handle_node *> *link = &get_handle_bucket(shard, hnd);
+	handle_node *node = link->load();
+	while (node && node->hnd != hnd) {
+		link = &node->next;
+		node = link->load();
+	}
+	if (!node)
+		return;
+
+	link->store(node->next.load());
+
+	/*
+	 * A reader may have sampled the epoch just before the previous flip, so wait for both
+	 * reader counts. Readers hold a count for a single bucket walk, so this is brief.
+	 */
+	for (int i = 0; i < 2; i++) {
+		uint32_t parity = shard.epoch.fetch_add(1) & 1;
+		while (shard.readers[parity].load())
+			std::this_thread::yield();
+	}
+
+	delete node;
+}
+
+std::shared_ptr<cros_gralloc_buffer> cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+{
+	/*
+	 * The returned reference keeps the buffer alive even if the handle is released
+	 * concurrently, so callers use it without holding any lock.
+	 */
+	auto &shard = get_handle_shard(hnd);
+	std::shared_ptr<cros_gralloc_buffer> buffer;
+
+	uint32_t parity = shard.epoch.load() & 1;
+	shard.readers[parity]++;
+
+	for (handle_node *node = get_handle_bucket(shard, hnd).load(); node;
+	     node = node->next.load()) {
+		if (node->hnd == hnd) {
+			buffer = node->buffer;
+			break;
+		}
+	}
+
+	shard.readers[parity]--;
+	return buffer;
 }
 
 void cros_gralloc_driver::with_buffer(cros_gralloc_handle_t hnd,
 				      const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
 		ALOGE("Invalid reference (with_buffer() called on unregistered handle).");
 		return;
 	}
 
-	function(buffer);
+	function(buffer.get());
 }
 
 void cros_gralloc_driver::with_each_buffer(
     const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> buffers;
+
+	for (auto &shard : buffer_shards_) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (const auto &pair : shard.buffers)
+			buffers.push_back(pair.second);
+	}
 
-	for (const auto &pair : buffers_)
-		function(pair.second.get());
+	for (const auto &buffer : buffers)
+		function(buffer.get());
 }
@@ -9,11 +9,18 @@
 
 #include "cros_gralloc_buffer.h"
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 #include <BufferAllocator/BufferAllocator.h>
@@ -29,6 +36,27 @@ class cros_gralloc_driver
 	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
 			 native_handle_t **out_handle);
 
+	/*
+	 * Lets allocate() hand out buffers that were allocated ahead of time, see the
+	 * preallocation pool below. Only meant for the allocator services, and only takes effect
+	 * when ro.vendor.minigbm.preallocation is set.
+	 */
+	void enable_preallocation();
+	/*
+	 * Marks this process as an allocator service, which hands its buffers off right away.
+	 * allocate() then leaves the memory budgets to the clients that import the buffers.
+	 */
+	void set_allocator_service();
+
+	struct preallocation_stats {
+		uint64_t hits;
+		uint64_t misses;
+		/* Total time spent in allocate() for each. */
+		uint64_t hit_ns;
+		uint64_t miss_ns;
+	};
+	preallocation_stats get_preallocation_stats();
+
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
 
@@ -53,15 +81,98 @@ class cros_gralloc_driver
 			 const std::function<void(cros_gralloc_buffer *)> &function);
 	void with_each_buffer(const std::function<void(cros_gralloc_buffer *)> &function);
 
+	/* Buffers are accounted to the first category their use flags match. */
+	enum memory_category : uint32_t {
+		kMemoryProtected,
+		kMemoryCamera,
+		kMemoryVideo,
+		kMemoryScanout,
+		kMemoryGpu,
+		kMemoryCpu,
+		kMemoryOther,
+		kNumMemoryCategories,
+	};
+
+	/*
+	 * Memory of the buffers this process has allocated or imported, counted once per buffer
+	 * no matter how many handles refer to it.
+	 */
+	struct memory_stats {
+		uint64_t num_buffers;
+		uint64_t total_bytes;
+		std::array<uint64_t, kNumMemoryCategories> category_bytes;
+		/* By heap: the bo from the DRM device and the reserved region for metadata. */
+		uint64_t device_bytes;
+		uint64_t reserved_region_bytes;
+		std::unordered_map<uint32_t, uint64_t> format_bytes;
+		/* Part of the above. */
+		uint64_t preallocated_bytes;
+		/* Released imports kept by the import cache, not part of the above. */
+		uint64_t import_cache_bytes;
+		/* 0 if unset. */
+		uint64_t soft_budget;
+		uint64_t hard_budget;
+	};
+	memory_stats get_memory_stats();
+	/*
+	 * get_memory_stats() in a few lines of text. The mapper dumps log it, since their buffer
+	 * lists have no place for totals over all buffers.
+	 */
+	std::string dump_memory_stats();
+
+	/* The totals of get_memory_stats() that the budgets apply to, cheap enough to poll. */
+	struct memory_usage {
+		uint64_t num_buffers;
+		/* Buffer bytes plus the import cache. */
+		uint64_t budgeted_bytes;
+		/* 0 if unset. */
+		uint64_t soft_budget;
+		uint64_t hard_budget;
+	};
+	memory_usage get_memory_usage();
+
+	struct import_cache_stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+	};
+	import_cache_stats get_import_cache_stats();
+
       private:
 	cros_gralloc_driver();
 	bool is_initialized();
-	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
+	std::shared_ptr<cros_gralloc_buffer> get_buffer(cros_gralloc_handle_t hnd);
 	bool
 	get_resolved_format_and_use_flags(const struct cros_gralloc_buffer_descriptor *descriptor,
 					  uint32_t *out_format, uint64_t *out_use_flags);
+	int32_t resolve_format_and_use_flags(const struct cros_gralloc_buffer_descriptor *descriptor,
+					     uint32_t *out_format, uint64_t *out_use_flags);
 
-	int create_reserved_region(const std::string &buffer_name, uint64_t reserved_region_size);
+	int create_reserved_region(const std::string &buffer_name, uint64_t reserved_region_size,
+				   uint64_t *reserved_region_offset);
+	int create_reserved_region_fd(const std::string &buffer_name,
+				      uint64_t reserved_region_size);
+	int alloc_reserved_arena_slot(uint64_t reserved_region_size,
+				      uint64_t *reserved_region_offset);
+
+	int32_t allocate_buffer(const struct cros_gralloc_buffer_descriptor *descriptor,
+				native_handle_t **out_handle, uint32_t budget_shrink);
+	bool take_preallocated(const struct cros_gralloc_buffer_descriptor *descriptor,
+			       native_handle_t **out_handle);
+	void record_allocate_latency(bool hit, std::chrono::steady_clock::duration latency);
+	bool drain_preallocation_pool();
+	void free_preallocated(native_handle_t *handle);
+	void preallocation_refiller();
+
+	void account_buffer(const cros_gralloc_buffer *buffer, bool add);
+	uint64_t get_budgeted_bytes();
+	int32_t check_memory_budget(uint64_t size, uint32_t shrink);
+
+	std::shared_ptr<cros_gralloc_buffer> take_cached_import(uint32_t id, ino_t inode);
+	void cache_import(std::shared_ptr<cros_gralloc_buffer> buffer);
+	void evict_imports(bool all, std::vector<std::shared_ptr<cros_gralloc_buffer>> *evicted);
+	bool flush_import_cache();
+	void import_cache_reaper();
 
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 	/* For allocating cros_gralloc_buffer reserved regions for metadata. */
@@ -70,20 +181,180 @@ class cros_gralloc_driver
 
 	std::unique_ptr<struct driver, void (*)(struct driver *)> drv_;
 
+	/*
+	 * Budgets on the bytes of this process' buffers plus the import cache, from
+	 * ro.vendor.minigbm.memory_budget.{soft,hard}_mb. Going over the soft budget empties the
+	 * import cache and the preallocation pool; allocations and imports that would still go
+	 * over the hard budget fail. Concurrent allocations may overshoot by the size of those in
+	 * flight, since the budgets are checked rather than reserved. An allocator service only
+	 * holds its buffers in flight, so there the budgets cover just the preallocation pool and
+	 * each client is held to them when it imports its buffers in retain().
+	 */
+	std::mutex memory_mutex_;
+	memory_stats memory_stats_ = {};
+	uint64_t memory_soft_budget_ = 0;
+	uint64_t memory_hard_budget_ = 0;
+	std::atomic<bool> allocator_service_{ false };
+
+	/*
+	 * With ro.vendor.minigbm.reserved_region_arena set, small reserved regions are carved out
+	 * of a shared arena file instead of getting one each, which saves a kernel allocation per
+	 * buffer and lets importers map the arena once. Slots are never reused, since other
+	 * processes may still use them; a full arena is dropped and freed by the kernel once the
+	 * last buffer in it goes away. Any importer of a buffer can access the whole arena, so
+	 * this is only for systems where buffer metadata needs no isolation between clients.
+	 */
+	bool use_reserved_arena_ = false;
+	std::mutex reserved_arena_mutex_;
+	int reserved_arena_fd_ = -1;
+	uint64_t reserved_arena_offset_ = 0;
+
 	struct cros_gralloc_imported_handle_info {
 		/*
 		 * The underlying buffer for referred to by this handle (as multiple handles can
 		 * refer to the same buffer).
 		 */
-		cros_gralloc_buffer *buffer = nullptr;
+		std::shared_ptr<cros_gralloc_buffer> buffer;
 
 		/* The handle's refcount as a handle can be imported multiple times.*/
 		int32_t refcount = 1;
 	};
 
-	std::mutex mutex_;
-	std::unordered_map<uint32_t, std::unique_ptr<cros_gralloc_buffer>> buffers_;
-	std::unordered_map<cros_gralloc_handle_t, cros_gralloc_imported_handle_info> handles_;
+	/*
+	 * Handles and buffers are striped over independently locked shards so that operations on
+	 * unrelated buffers don't serialize behind each other. A shard lock only covers writers and
+	 * refcounts; the buffer's own lock covers its lock/unlock state. When both are needed, the
+	 * handle shard is locked before the buffer shard.
+	 */
+	static constexpr size_t kNumShards = 16;
+
+	/*
+	 * Handle lookups never take the shard lock. Each shard also keeps its handles in fixed
+	 * buckets of singly linked nodes that writers edit in place: publishing a handle pushes a
+	 * fully built node onto its bucket and retiring one unlinks it, so neither copies the rest
+	 * of the table. A reader announces itself in readers[epoch & 1]; a writer frees an unlinked
+	 * node only once both reader counts have drained after it flipped the epoch twice.
+	 */
+	static constexpr size_t kHandleBuckets = 64;
+
+	struct handle_node {
+		cros_gralloc_handle_t hnd;
+		std::shared_ptr<cros_gralloc_buffer> buffer;
+		std::atomic<handle_node *> next{ nullptr };
+	};
+
+	struct handle_shard {
+		std::mutex mutex;
+		std::unordered_map<cros_gralloc_handle_t, cros_gralloc_imported_handle_info> handles;
+
+		std::array<std::atomic<handle_node *>, kHandleBuckets> buckets{};
+		std::atomic<uint32_t> epoch{ 0 };
+		std::atomic<int32_t> readers[2] = { { 0 }, { 0 } };
+	};
+
+	struct buffer_shard {
+		std::mutex mutex;
+		std::unordered_map<uint32_t, std::shared_ptr<cros_gralloc_buffer>> buffers;
+	};
+
+	handle_shard &get_handle_shard(cros_gralloc_handle_t hnd);
+	std::atomic<handle_node *> &get_handle_bucket(handle_shard &shard, cros_gralloc_handle_t hnd);
+	void publish_handle(handle_shard &shard, cros_gralloc_handle_t hnd,
+			    const std::shared_ptr<cros_gralloc_buffer> &buffer);
+	void retire_handle(handle_shard &shard, cros_gralloc_handle_t hnd);
+	buffer_shard &get_buffer_shard(uint32_t id);
+
+	std::array<handle_shard, kNumShards> handle_shards_;
+	std::array<buffer_shard, kNumShards> buffer_shards_;
+
+	/*
+	 * Results of resolve_format_and_use_flags(), which runs a test allocation and up to three
+	 * combination lookups, for every descriptor seen so far. They only depend on the
+	 * descriptor and on drv_, so they stay valid for the lifetime of this driver. Errors other
+	 * than the descriptor being unsupported may be transient and are not kept.
+	 */
+	struct resolved_format_key {
+		uint32_t width;
+		uint32_t height;
+		int32_t droid_format;
+		int64_t droid_usage;
+		uint32_t drm_format;
+		uint64_t use_flags;
+
+		bool operator==(const resolved_format_key &other) const;
+	};
+
+	struct resolved_format_key_hash {
+		size_t operator()(const resolved_format_key &key) const;
+	};
+
+	struct resolved_format {
+		bool supported;
+		uint32_t format;
+		uint64_t use_flags;
+	};
+
+	struct resolved_format_shard {
+		std::mutex mutex;
+		std::unordered_map<resolved_format_key, resolved_format, resolved_format_key_hash>
+		    entries;
+	};
+
+	std::array<resolved_format_shard, kNumShards> resolved_format_shards_;
+
+	/*
+	 * Imported buffers whose last handle was released are kept around for a short grace
+	 * period, since clients often re-import the same buffer moments later (e.g. a buffer queue
+	 * cycling through its slots). A retain() of a cached buffer revives it without going
+	 * through drv_bo_import() and the backend's prime import. Entries are evicted oldest first
+	 * once they expire or the cache exceeds its entry, byte or fd budget; the fds of cached
+	 * buffers stay open, so an import that fails also empties the cache before retrying.
+	 * Only ever locked after the buffer shard lock.
+	 */
+	struct cached_import {
+		std::shared_ptr<cros_gralloc_buffer> buffer;
+		uint32_t id;
+		ino_t inode;
+		std::chrono::steady_clock::time_point expiry;
+	};
+
+	std::mutex import_cache_mutex_;
+	std::condition_variable import_cache_cv_;
+	/* Oldest first. */
+	std::list<cached_import> import_cache_;
+	uint64_t import_cache_bytes_ = 0;
+	uint32_t import_cache_fds_ = 0;
+	uint32_t import_cache_max_fds_ = 0;
+	import_cache_stats import_cache_stats_ = {};
+	uint64_t import_cache_reported_lookups_ = 0;
+	/* Started on the first insertion, wakes up to drop expired entries. */
+	std::thread import_cache_reaper_;
+	bool import_cache_stop_ = false;
+
+	/*
+	 * The allocator services allocate every buffer inside the binder call, so setting up a
+	 * new buffer queue stalls on the kernel allocating and clearing its pages. The pool
+	 * learns which descriptors are allocated again and again (each allocation bumps the score
+	 * of its shape, and scores halve every tick) and keeps a few buffers of the hottest
+	 * shapes ready, topped up by a low priority thread. Pooled buffers go away once their
+	 * shape cools down, when allocating fails, and when the system runs low on memory.
+	 */
+	struct preallocation_shape {
+		struct cros_gralloc_buffer_descriptor descriptor;
+		uint32_t score;
+		std::vector<native_handle_t *> ready;
+	};
+
+	std::atomic<bool> preallocation_enabled_{ false };
+	std::mutex preallocation_mutex_;
+	std::condition_variable preallocation_cv_;
+	/* Only the refiller thread removes shapes, so it may keep iterators while unlocked. */
+	std::list<preallocation_shape> preallocation_shapes_;
+	uint64_t preallocation_bytes_ = 0;
+	bool preallocation_refill_ = false;
+	bool preallocation_stop_ = false;
+	preallocation_stats preallocation_stats_ = {};
+	std::thread preallocation_refiller_;
 };
 
 #endif
@@ -40,6 +40,8 @@ struct cros_gralloc_handle : public native_handle_t {
 	uint32_t num_planes;
 	uint64_t reserved_region_size;
 	uint64_t total_size; /* Total allocation size */
+	/* Offset of the reserved region in its file, which may be shared with other buffers. */
+	uint64_t reserved_region_offset;
 } __attribute__((packed));
 
 typedef const struct cros_gralloc_handle *cros_gralloc_handle_t;
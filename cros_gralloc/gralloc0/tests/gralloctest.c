@@ -12,9 +12,13 @@
  */
 
 #define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cutils/native_handle.h>
@@ -653,6 +657,379 @@ static int test_async(struct gralloctest_context *ctx)
 	return 1;
 }
 
+#define SCALING_ITERATIONS 20000
+#define SCALING_MAX_THREADS 8
+
+struct scaling_thread {
+	struct gralloctest_context *ctx;
+	pthread_barrier_t *barrier;
+	uint32_t index;
+	int success;
+};
+
+static void *scaling_thread_main(void *arg)
+{
+	struct scaling_thread *thread = arg;
+	struct gralloc_module_t *mod = thread->ctx->module;
+	struct grallocinfo info;
+	uint64_t first_id = 0, id;
+	uint32_t i;
+	int ok = 1;
+
+	grallocinfo_init(&info, 64, 64, HAL_PIXEL_FORMAT_BGRA_8888,
+			 GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN);
+	ok = allocate(thread->ctx->device, &info) &&
+	     mod->perform(mod, GRALLOC_DRM_GET_BACKING_STORE, info.handle, &first_id) == 0;
+
+	pthread_barrier_wait(thread->barrier);
+
+	/*
+	 * Every lock must see what this thread wrote under the previous one, and the buffer must
+	 * keep its identity, however the other threads' buffers come and go.
+	 */
+	for (i = 0; ok && i < SCALING_ITERATIONS; i++) {
+		volatile uint32_t *pixel;
+
+		ok = lock(mod, &info);
+		if (!ok)
+			break;
+
+		pixel = info.vaddr;
+		if (i && *pixel != ((thread->index << 24) | (i - 1)))
+			ok = 0;
+		*pixel = (thread->index << 24) | i;
+
+		ok = unlock(mod, &info) && ok &&
+		     mod->perform(mod, GRALLOC_DRM_GET_BACKING_STORE, info.handle, &id) == 0 &&
+		     id == first_id;
+	}
+
+	pthread_barrier_wait(thread->barrier);
+
+	if (ok)
+		ok = deallocate(thread->ctx->device, &info);
+
+	thread->success = ok;
+	return NULL;
+}
+
+/*
+ * This function checks that lock/unlock and metadata queries on unrelated buffers from a growing
+ * number of threads keep each buffer's contents and identity, and reports the throughput. With
+ * per-buffer locking the throughput should scale with the thread count.
+ */
+static int test_lock_scaling(struct gralloctest_context *ctx)
+{
+	struct scaling_thread threads[SCALING_MAX_THREADS];
+	pthread_t ids[SCALING_MAX_THREADS];
+	pthread_barrier_t barrier;
+	struct timespec start, end;
+	int num_threads, i;
+	double seconds, rate, base_rate = 0;
+
+	for (num_threads = 1; num_threads <= SCALING_MAX_THREADS; num_threads *= 2) {
+		CHECK(pthread_barrier_init(&barrier, NULL, num_threads + 1) == 0);
+
+		for (i = 0; i < num_threads; i++) {
+			threads[i].ctx = ctx;
+			threads[i].barrier = &barrier;
+			threads[i].index = i;
+			threads[i].success = 0;
+			CHECK(pthread_create(&ids[i], NULL, scaling_thread_main, &threads[i]) == 0);
+		}
+
+		pthread_barrier_wait(&barrier);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_barrier_wait(&barrier);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		for (i = 0; i < num_threads; i++) {
+			pthread_join(ids[i], NULL);
+			CHECK(threads[i].success);
+		}
+
+		pthread_barrier_destroy(&barrier);
+
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		rate = num_threads * SCALING_ITERATIONS / seconds;
+		if (num_threads == 1)
+			base_rate = rate;
+
+		printf("[   INFO   ] %d thread(s): %.0f lock/unlock/perform per second (%.2fx)\n",
+		       num_threads, rate, rate / base_rate);
+	}
+
+	return 1;
+}
+
+#define LATENCY_BUFFERS 64
+#define LATENCY_LOOKUPS 200000
+
+struct churn_thread {
+	struct gralloctest_context *ctx;
+	struct grallocinfo *info;
+	uint64_t id;
+	volatile int stop;
+	int success;
+};
+
+static void *churn_thread_main(void *arg)
+{
+	struct churn_thread *churn = arg;
+	struct grallocinfo duplicate = *churn->info;
+	int ok = 1;
+
+	duplicate.handle = duplicate_buffer_handle(churn->info->handle);
+	ok = duplicate.handle != NULL;
+
+	/* Every import of the duplicate must resolve to the original buffer. */
+	while (ok && !churn->stop) {
+		struct gralloc_module_t *mod = churn->ctx->module;
+		uint64_t id = 0;
+
+		ok = register_buffer(mod, &duplicate) &&
+		     mod->perform(mod, GRALLOC_DRM_GET_BACKING_STORE, duplicate.handle, &id) == 0 &&
+		     id == churn->id;
+		ok = unregister_buffer(mod, &duplicate) && ok;
+	}
+
+	if (duplicate.handle) {
+		native_handle_close((native_handle_t *)duplicate.handle);
+		native_handle_delete((native_handle_t *)duplicate.handle);
+	}
+
+	churn->success = ok;
+	return NULL;
+}
+
+static int measure_lookups(struct gralloctest_context *ctx, struct grallocinfo *infos,
+			   const uint64_t *ids, double *ns_per_lookup)
+{
+	struct gralloc_module_t *mod = ctx->module;
+	struct timespec start, end;
+	uint64_t id;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LATENCY_LOOKUPS; i++) {
+		CHECK(mod->perform(mod, GRALLOC_DRM_GET_BACKING_STORE,
+				   infos[i % LATENCY_BUFFERS].handle, &id) == 0);
+		CHECK(id == ids[i % LATENCY_BUFFERS]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*ns_per_lookup =
+	    ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / LATENCY_LOOKUPS;
+	return 1;
+}
+
+/*
+ * This function checks that handle lookups keep resolving to the right buffers while another
+ * thread keeps importing and releasing a handle, and reports their latency with and without the
+ * imports. Lookups should not slow down behind the imports.
+ */
+static int test_lookup_latency(struct gralloctest_context *ctx)
+{
+	struct gralloc_module_t *mod = ctx->module;
+	struct grallocinfo infos[LATENCY_BUFFERS];
+	uint64_t ids[LATENCY_BUFFERS];
+	struct churn_thread churn;
+	pthread_t churn_id;
+	double idle_ns, churn_ns;
+	int i, ok;
+
+	for (i = 0; i < LATENCY_BUFFERS; i++) {
+		grallocinfo_init(&infos[i], 64, 64, HAL_PIXEL_FORMAT_BGRA_8888,
+				 GRALLOC_USAGE_SW_READ_OFTEN);
+		CHECK(allocate(ctx->device, &infos[i]));
+		CHECK(mod->perform(mod, GRALLOC_DRM_GET_BACKING_STORE, infos[i].handle, &ids[i]) ==
+		      0);
+	}
+
+	CHECK(measure_lookups(ctx, infos, ids, &idle_ns));
+
+	churn.ctx = ctx;
+	churn.info = &infos[0];
+	churn.id = ids[0];
+	churn.stop = 0;
+	churn.success = 0;
+	CHECK(pthread_create(&churn_id, NULL, churn_thread_main, &churn) == 0);
+	ok = measure_lookups(ctx, infos, ids, &churn_ns);
+	churn.stop = 1;
+	pthread_join(churn_id, NULL);
+	CHECK(ok);
+	CHECK(churn.success);
+
+	printf("[   INFO   ] lookup: %.1f ns idle, %.1f ns with concurrent imports\n", idle_ns,
+	       churn_ns);
+
+	for (i = 0; i < LATENCY_BUFFERS; i++)
+		CHECK(deallocate(ctx->device, &infos[i]));
+
+	return 1;
+}
+
+#define LOCK_LATENCY_ITERATIONS 2000
+
+static int measure_lock_unlock(struct gralloctest_context *ctx, struct grallocinfo *info,
+			       double *ns_per_lock)
+{
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LOCK_LATENCY_ITERATIONS; i++) {
+		CHECK(lock(ctx->module, info));
+		CHECK(info->vaddr);
+		/* The write under the previous lock must have survived the unlock. */
+		CHECK(!i || *(volatile uint8_t *)info->vaddr == (uint8_t)(i - 1));
+		*(volatile uint8_t *)info->vaddr = (uint8_t)i;
+		CHECK(unlock(ctx->module, info));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*ns_per_lock = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+		       LOCK_LATENCY_ITERATIONS;
+	return 1;
+}
+
+/*
+ * This function checks that CPU writes survive unlock for buffers allocated for frequent and for
+ * rare CPU access, and compares their lock/unlock latency. The former may keep their mapping
+ * across unlock and should then lock faster.
+ */
+static int test_lock_latency(struct gralloctest_context *ctx)
+{
+	struct grallocinfo often, rarely;
+	double often_ns, rarely_ns;
+
+	grallocinfo_init(&often, 1280, 720, HAL_PIXEL_FORMAT_RGBA_8888,
+			 GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN);
+	grallocinfo_init(&rarely, 1280, 720, HAL_PIXEL_FORMAT_RGBA_8888,
+			 GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_RARELY);
+	CHECK(allocate(ctx->device, &often));
+	CHECK(allocate(ctx->device, &rarely));
+
+	CHECK(measure_lock_unlock(ctx, &often, &often_ns));
+	CHECK(measure_lock_unlock(ctx, &rarely, &rarely_ns));
+
+	printf("[   INFO   ] lock/unlock: %.1f ns SW_OFTEN, %.1f ns SW_RARELY (%.2fx)\n", often_ns,
+	       rarely_ns, rarely_ns / often_ns);
+
+	CHECK(deallocate(ctx->device, &often));
+	CHECK(deallocate(ctx->device, &rarely));
+
+	return 1;
+}
+
+/* sw_sync timelines; the uapi is not exported by the kernel headers. */
+#define SW_SYNC_PATH "/sys/kernel/debug/sync/sw_sync"
+
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR('W', 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW('W', 1, uint32_t)
+
+#define FENCE_LATENCY_ITERATIONS 200
+#define FENCE_LATENCY_DELAY_NS 2000000
+
+struct fence_signaller {
+	int timeline;
+	struct timespec signaled;
+	int success;
+};
+
+static void *fence_signaller_main(void *arg)
+{
+	struct fence_signaller *signaller = arg;
+	struct timespec delay = { 0, FENCE_LATENCY_DELAY_NS };
+	uint32_t one = 1;
+
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &signaller->signaled);
+	signaller->success = ioctl(signaller->timeline, SW_SYNC_IOC_INC, &one) == 0;
+	return NULL;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * This function checks that lockAsync() waits for an acquire fence that signals a fixed time
+ * after the call, and reports how long it takes to return once the fence has signaled. Mapping
+ * setup overlaps with the wait, so that should be well below the time an unfenced lock takes.
+ */
+static int test_fence_latency(struct gralloctest_context *ctx)
+{
+	struct grallocinfo info;
+	struct fence_signaller signaller;
+	struct sw_sync_create_fence_data data;
+	struct timespec start, end;
+	pthread_t signaller_id;
+	double unfenced_ns = 0, after_signal_ns = 0;
+	int i, ok;
+
+	signaller.timeline = open(SW_SYNC_PATH, O_RDWR | O_CLOEXEC);
+	if (signaller.timeline < 0) {
+		printf("[   INFO   ] sw_sync is not available, skipping.\n");
+		return 1;
+	}
+
+	grallocinfo_init(&info, 1920, 1080, HAL_PIXEL_FORMAT_RGBA_8888,
+			 GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_RARELY);
+	CHECK(allocate(ctx->device, &info));
+
+	for (i = 0; i < FENCE_LATENCY_ITERATIONS; i++) {
+		info.fence_fd = -1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		CHECK(lock_async(ctx->module, &info));
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		CHECK(unlock_async(ctx->module, &info));
+		if (info.fence_fd >= 0)
+			CHECK(close(info.fence_fd) == 0);
+		unfenced_ns += elapsed_ns(&start, &end);
+	}
+
+	for (i = 0; i < FENCE_LATENCY_ITERATIONS; i++) {
+		memset(&data, 0, sizeof(data));
+		data.value = i + 1;
+		strcpy(data.name, "gralloctest");
+		CHECK(ioctl(signaller.timeline, SW_SYNC_IOC_CREATE_FENCE, &data) == 0);
+
+		signaller.success = 0;
+		CHECK(pthread_create(&signaller_id, NULL, fence_signaller_main, &signaller) == 0);
+
+		info.fence_fd = data.fence;
+		ok = lock_async(ctx->module, &info);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		pthread_join(signaller_id, NULL);
+		CHECK(ok);
+		CHECK(signaller.success);
+		/* lockAsync() must not return before the acquire fence has signaled. */
+		CHECK(elapsed_ns(&signaller.signaled, &end) > 0);
+
+		CHECK(unlock_async(ctx->module, &info));
+		if (info.fence_fd >= 0)
+			CHECK(close(info.fence_fd) == 0);
+		after_signal_ns += elapsed_ns(&signaller.signaled, &end);
+	}
+
+	printf("[   INFO   ] lockAsync: %.1f us unfenced, %.1f us after the fence signals\n",
+	       unfenced_ns / FENCE_LATENCY_ITERATIONS / 1000,
+	       after_signal_ns / FENCE_LATENCY_ITERATIONS / 1000);
+
+	CHECK(deallocate(ctx->device, &info));
+	close(signaller.timeline);
+
+	return 1;
+}
+
 static const struct gralloc_testcase tests[] = {
 	{ "alloc_varying_sizes", test_alloc_varying_sizes, 1 },
 	{ "alloc_combinations", test_alloc_combinations, 1 },
@@ -663,6 +1040,10 @@ static const struct gralloc_testcase tests[] = {
 	{ "ycbcr", test_ycbcr, 2 },
 	{ "yuv_info", test_yuv_info, 2 },
 	{ "async", test_async, 3 },
+	{ "lock_scaling", test_lock_scaling, 1 },
+	{ "lookup_latency", test_lookup_latency, 1 },
+	{ "lock_latency", test_lock_latency, 1 },
+	{ "fence_latency", test_fence_latency, 3 },
 };
 
 static void print_help(const char *argv0)
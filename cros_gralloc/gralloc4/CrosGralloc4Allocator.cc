@@ -28,7 +28,13 @@ using BufferDescriptorInfo =
 
 Error CrosGralloc4Allocator::init() {
     mDriver = cros_gralloc_driver::get_instance();
-    return mDriver ? Error::NONE : Error::NO_RESOURCES;
+    if (!mDriver) {
+        return Error::NO_RESOURCES;
+    }
+
+    mDriver->set_allocator_service();
+    mDriver->enable_preallocation();
+    return Error::NONE;
 }
 
 Error CrosGralloc4Allocator::initializeMetadata(
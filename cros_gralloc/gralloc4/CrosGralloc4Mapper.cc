@@ -13,6 +13,7 @@
 #include <cutils/native_handle.h>
 #include <cutils/properties.h>
 #include <gralloctypes/Gralloc4.h>
+#include <unistd.h>
 
 #include "cros_gralloc/cros_gralloc_helpers.h"
 #include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
@@ -318,6 +319,11 @@ Return<void> CrosGralloc4Mapper::unlock(void* rawHandle, unlock_cb hidlCb) {
 
     NATIVE_HANDLE_DECLARE_STORAGE(releaseFenceHandleStorage, 1, 0);
     hidlCb(Error::NONE, convertToFenceHandle(releaseFenceFd, releaseFenceHandleStorage));
+
+    // The callee owns the fence; clients dup() it inside the callback.
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -1031,6 +1037,8 @@ Return<void> CrosGralloc4Mapper::dumpBuffers(dumpBuffers_cb hidlCb) {
     mDriver->with_each_buffer(
             [&](cros_gralloc_buffer* crosBuffer) { dumpBuffer(crosBuffer, dumpBufferCallback); });
 
+    ALOGI("%s", mDriver->dump_memory_stats().c_str());
+
     hidlCb(error, bufferDumps);
     return Void();
 }
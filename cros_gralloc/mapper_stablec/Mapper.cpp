@@ -650,6 +650,7 @@ AIMapper_Error CrosGrallocMapperV5::dumpAllBuffers(
         beginDumpBufferCallback(context);
         dumpBuffer(crosBuffer, callback);
     });
+    ALOGI("%s", mDriver->dump_memory_stats().c_str());
     return AIMAPPER_ERROR_NONE;
 }
 
@@ -397,24 +397,30 @@ int dri_bo_destroy(struct dri_driver *dri, struct bo *bo)
 }
 
 /*
- * Map an image plane.
+ * Map a region of an image plane.
  *
  * This relies on the underlying driver to do a decompressing and/or de-tiling
- * blit if necessary,
+ * blit if necessary, so only the requested rect is mapped.  The returned
+ * address is biased such that it points to the origin of the plane, like a
+ * full mapping.
  *
  * This function itself is not thread-safe; we rely on the fact that the caller
  * locks a per-driver mutex.
  */
-void *dri_bo_map(struct dri_driver *dri, struct bo *bo, struct vma *vma, size_t plane,
-		 uint32_t map_flags)
+void *dri_bo_map(struct dri_driver *dri, struct bo *bo, struct vma *vma,
+		 const struct rectangle *rect, size_t plane, uint32_t map_flags)
 {
 	/* GBM flags and DRI flags are the same. */
-	vma->addr = dri->image_extension->mapImage(dri->context, bo->priv, 0, 0, bo->meta.width,
-						   bo->meta.height, map_flags,
-						   (int *)&vma->map_strides[plane], &vma->priv);
-	if (!vma->addr)
+	uint8_t *addr = dri->image_extension->mapImage(
+	    dri->context, bo->priv, rect->x, rect->y, rect->width, rect->height, map_flags,
+	    (int *)&vma->map_strides[plane], &vma->priv);
+	if (!addr)
 		return MAP_FAILED;
 
+	const uint32_t bpp = drv_bytes_per_pixel_from_format(bo->meta.format, plane);
+	vma->addr = addr - (vma->map_strides[plane] * rect->y + bpp * rect->x);
+	vma->rect = *rect;
+
 	return vma->addr;
 }
 
@@ -70,8 +70,8 @@ int dri_bo_create_with_modifiers(struct dri_driver *dri, struct bo *bo, uint32_t
 int dri_bo_import(struct dri_driver *dri, struct bo *bo, struct drv_import_fd_data *data);
 int dri_bo_release(struct dri_driver *dri, struct bo *bo);
 int dri_bo_destroy(struct dri_driver *dri, struct bo *bo);
-void *dri_bo_map(struct dri_driver *dri, struct bo *bo, struct vma *vma, size_t plane,
-		 uint32_t map_flags);
+void *dri_bo_map(struct dri_driver *dri, struct bo *bo, struct vma *vma,
+		 const struct rectangle *rect, size_t plane, uint32_t map_flags);
 int dri_bo_unmap(struct dri_driver *dri, struct bo *bo, struct vma *vma);
 
 size_t dri_num_planes_from_modifier(struct dri_driver *dri, uint32_t format, uint64_t modifier);
@@ -130,6 +130,67 @@ static const struct backend *drv_get_backend(int fd)
 }
 #endif
 
+struct format_support {
+	uint32_t format;
+	uint64_t use_flags;
+};
+
+static int compare_format_support(const void *a, const void *b)
+{
+	const struct format_support *lhs = a;
+	const struct format_support *rhs = b;
+
+	if (lhs->format != rhs->format)
+		return lhs->format < rhs->format ? -1 : 1;
+	/* wider masks first, so that lookups usually succeed on the first entry */
+	if (lhs->use_flags != rhs->use_flags)
+		return lhs->use_flags > rhs->use_flags ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Flattens the combos into a table of (format, use_flags) sorted by format,
+ * dropping the masks that are covered by another mask of the same format.
+ * On failure, drv_has_combination falls back to drv_get_combination.
+ */
+static void drv_build_format_table(struct driver *drv)
+{
+	const uint32_t count = drv_array_size(drv->combos);
+	struct format_support *table;
+	uint32_t i, j, size = 0;
+
+	free(drv->format_table);
+	drv->format_table = NULL;
+	drv->format_table_size = 0;
+
+	table = calloc(count ? count : 1, sizeof(*table));
+	if (!table)
+		return;
+
+	for (i = 0; i < count; i++) {
+		const struct combination *combo = drv_array_at_idx(drv->combos, i);
+		table[i].format = combo->format;
+		table[i].use_flags = combo->use_flags;
+	}
+	qsort(table, count, sizeof(*table), compare_format_support);
+
+	for (i = 0; i < count; i++) {
+		bool covered = false;
+		for (j = size; j > 0 && table[j - 1].format == table[i].format; j--) {
+			if ((table[j - 1].use_flags & table[i].use_flags) == table[i].use_flags) {
+				covered = true;
+				break;
+			}
+		}
+		if (!covered)
+			table[size++] = table[i];
+	}
+
+	drv->format_table = table;
+	drv->format_table_size = size;
+	drv->format_table_stale = false;
+}
+
 struct driver *drv_create(int fd)
 {
 	struct driver *drv;
@@ -178,6 +239,8 @@ struct driver *drv_create(int fd)
 		}
 	}
 
+	drv_build_format_table(drv);
+
 	return drv;
 
 free_mappings:
@@ -199,6 +262,7 @@ void drv_destroy(struct driver *drv)
 		drv->backend->close(drv);
 
 	drv_array_destroy(drv->combos);
+	free(drv->format_table);
 
 	drv_array_destroy(drv->mappings);
 	pthread_mutex_destroy(&drv->mappings_lock);
@@ -238,6 +302,33 @@ struct combination *drv_get_combination(struct driver *drv, uint32_t format, uin
 	return best;
 }
 
+bool drv_has_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
+{
+	uint32_t lo = 0, hi = drv->format_table_size;
+
+	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
+		return false;
+
+	if (!drv->format_table || drv->format_table_stale)
+		return drv_get_combination(drv, format, use_flags) != NULL;
+
+	/* find the first entry of the format */
+	while (lo < hi) {
+		const uint32_t mid = lo + (hi - lo) / 2;
+		if (drv->format_table[mid].format < format)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < drv->format_table_size && drv->format_table[lo].format == format; lo++) {
+		if ((drv->format_table[lo].use_flags & use_flags) == use_flags)
+			return true;
+	}
+
+	return false;
+}
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags, bool is_test_buffer)
 {
@@ -306,11 +397,11 @@ static void drv_bo_mapping_destroy(struct bo *bo)
 /*
  * Acquire a reference on plane buffers of the bo.
  */
-static void drv_bo_acquire(struct bo *bo)
+/* Takes a reference on plane buffers of the bo. Called with buffer_table_lock held. */
+static void drv_bo_acquire_locked(struct bo *bo)
 {
 	struct driver *drv = bo->drv;
 
-	pthread_mutex_lock(&drv->buffer_table_lock);
 	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
 		uintptr_t num = 0;
 		if (!bo->inode) {
@@ -324,6 +415,14 @@ static void drv_bo_acquire(struct bo *bo)
 
 		drmHashInsert(drv->buffer_table, bo->inode, (void *)(num + 1));
 	}
+}
+
+static void drv_bo_acquire(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+
+	pthread_mutex_lock(&drv->buffer_table_lock);
+	drv_bo_acquire_locked(bo);
 	pthread_mutex_unlock(&drv->buffer_table_lock);
 }
 
@@ -457,61 +556,153 @@ void drv_bo_destroy(struct bo *bo)
 	free(bo);
 }
 
-struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
+/*
+ * Inode and size of a dma-buf fd, looked up once per import batch. Swapchains and multi-planar
+ * buffers commonly pass the same fd for several planes or buffers.
+ */
+struct drv_import_fd_info {
+	int fd;
+	uint32_t inode;
+	off_t size;
+};
+
+static struct drv_import_fd_info *drv_import_fd_info_get(struct drv_import_fd_info *infos,
+							 size_t *num_infos, int fd)
+{
+	struct drv_import_fd_info *info;
+	size_t i;
+
+	for (i = 0; i < *num_infos; i++) {
+		if (infos[i].fd == fd)
+			return &infos[i];
+	}
+
+	info = &infos[*num_infos];
+	info->fd = fd;
+	info->inode = 0;
+	info->size = lseek(fd, 0, SEEK_END);
+	if (info->size == (off_t)(-1)) {
+		drv_loge("lseek() failed with %s\n", strerror(errno));
+		return NULL;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	(*num_infos)++;
+
+	return info;
+}
+
+static int drv_bo_import_one(struct driver *drv, struct drv_import_fd_data *data,
+			     struct drv_import_fd_info *infos, size_t *num_infos, struct bo **out_bo)
 {
 	int ret;
 	size_t plane;
 	struct bo *bo;
-	off_t seek_end;
+	struct drv_import_fd_info *info[DRV_MAX_PLANES];
+	int64_t sizes[DRV_MAX_PLANES];
 
 	bo = drv_bo_new(drv, data->width, data->height, data->format, data->use_flags, false);
 
 	if (!bo)
-		return NULL;
+		return -ENOMEM;
 
-	ret = drv->backend->bo_import(bo, data);
-	if (ret) {
-		free(bo);
-		return NULL;
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		info[plane] = drv_import_fd_info_get(infos, num_infos, data->fds[plane]);
+		if (!info[plane]) {
+			ret = -errno;
+			goto free_bo;
+		}
+
+		if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
+			sizes[plane] = info[plane]->size - data->offsets[plane];
+		else
+			sizes[plane] = data->offsets[plane + 1] - data->offsets[plane];
+
+		if ((int64_t)data->offsets[plane] + sizes[plane] > info[plane]->size) {
+			drv_loge("buffer size is too large.\n");
+			ret = -EINVAL;
+			goto free_bo;
+		}
 	}
 
-	bo->inode = drv_get_inode(data->fds[0]);
+	ret = drv->backend->bo_import(bo, data);
+	if (ret)
+		goto free_bo;
 
-	drv_bo_acquire(bo);
+	if (!info[0]->inode)
+		info[0]->inode = drv_get_inode(data->fds[0]);
+	bo->inode = info[0]->inode;
 
 	bo->meta.format_modifier = data->format_modifier;
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		bo->meta.strides[plane] = data->strides[plane];
 		bo->meta.offsets[plane] = data->offsets[plane];
+		bo->meta.sizes[plane] = sizes[plane];
+		bo->meta.total_size += sizes[plane];
+	}
 
-		seek_end = lseek(data->fds[plane], 0, SEEK_END);
-		if (seek_end == (off_t)(-1)) {
-			drv_loge("lseek() failed with %s\n", strerror(errno));
-			goto destroy_bo;
-		}
+	*out_bo = bo;
+	return 0;
 
-		lseek(data->fds[plane], 0, SEEK_SET);
-		if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
-			bo->meta.sizes[plane] = seek_end - data->offsets[plane];
-		else
-			bo->meta.sizes[plane] = data->offsets[plane + 1] - data->offsets[plane];
+free_bo:
+	free(bo);
+	return ret;
+}
 
-		if ((int64_t)bo->meta.offsets[plane] + bo->meta.sizes[plane] > seek_end) {
-			drv_loge("buffer size is too large.\n");
-			goto destroy_bo;
+/*
+ * Imports count buffers in one call. Either all of them are imported and 0 is returned, or none
+ * are and a negative errno is returned.
+ */
+int drv_bo_import_batch(struct driver *drv, struct drv_import_fd_data *data, size_t count,
+			struct bo **bos)
+{
+	struct drv_import_fd_info *infos;
+	size_t num_infos = 0;
+	size_t i, imported;
+	int ret = 0;
+
+	infos = calloc(count * DRV_MAX_PLANES, sizeof(*infos));
+	if (!infos)
+		return -ENOMEM;
+
+	for (imported = 0; imported < count; imported++) {
+		ret = drv_bo_import_one(drv, &data[imported], infos, &num_infos, &bos[imported]);
+		if (ret)
+			break;
+	}
+
+	free(infos);
+
+	/* Buffers of a batch often share an inode, so take the table lock once for all of them. */
+	pthread_mutex_lock(&drv->buffer_table_lock);
+	for (i = 0; i < imported; i++)
+		drv_bo_acquire_locked(bos[i]);
+	pthread_mutex_unlock(&drv->buffer_table_lock);
+
+	if (imported < count) {
+		for (i = 0; i < imported; i++) {
+			drv_bo_destroy(bos[i]);
+			bos[i] = NULL;
 		}
+		return ret;
+	}
 
-		bo->meta.total_size += bo->meta.sizes[plane];
+	if (drv->log_bos) {
+		for (i = 0; i < count; i++)
+			drv_bo_log_info(bos[i], "imported");
 	}
 
-	if (drv->log_bos)
-		drv_bo_log_info(bo, "imported");
+	return 0;
+}
 
-	return bo;
+struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
+{
+	struct bo *bo;
 
-destroy_bo:
-	drv_bo_destroy(bo);
-	return NULL;
+	if (drv_bo_import_batch(drv, data, 1, &bo))
+		return NULL;
+
+	return bo;
 }
 
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
@@ -521,6 +712,9 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	uint32_t i;
 	uint8_t *addr;
 	struct mapping mapping = { 0 };
+	bool invalidate = !(map_flags & BO_MAP_DEFER_INVALIDATE);
+
+	map_flags &= ~BO_MAP_DEFER_INVALIDATE;
 
 	assert(rect->width >= 0);
 	assert(rect->height >= 0);
@@ -554,9 +748,15 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 
 	for (i = 0; i < drv_array_size(drv->mappings); i++) {
 		struct mapping *prior = (struct mapping *)drv_array_at_idx(drv->mappings, i);
+		const struct rectangle *covered = &prior->vma->rect;
 		if (prior->vma->inode != bo->inode || prior->vma->map_flags != map_flags)
 			continue;
 
+		if (rect->x < covered->x || rect->y < covered->y ||
+		    rect->x + rect->width > covered->x + covered->width ||
+		    rect->y + rect->height > covered->y + covered->height)
+			continue;
+
 		prior->vma->refcount++;
 		mapping.vma = prior->vma;
 		goto success;
@@ -570,7 +770,13 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	}
 
 	memcpy(mapping.vma->map_strides, bo->meta.strides, sizeof(mapping.vma->map_strides));
-	addr = drv->backend->bo_map(bo, mapping.vma, map_flags);
+	mapping.vma->rect.width = drv_bo_get_width(bo);
+	mapping.vma->rect.height = drv_bo_get_height(bo);
+	if (drv->backend->bo_map_rect)
+		addr = drv->backend->bo_map_rect(bo, mapping.vma, rect,
+						 map_flags & ~BO_MAP_PERSISTENT);
+	else
+		addr = drv->backend->bo_map(bo, mapping.vma, map_flags & ~BO_MAP_PERSISTENT);
 	if (addr == MAP_FAILED) {
 		*map_data = NULL;
 		free(mapping.vma);
@@ -586,7 +792,8 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 success:
 	*map_data = drv_array_append(drv->mappings, &mapping);
 exact_match:
-	drv_bo_invalidate(bo, *map_data);
+	if (invalidate && (!(map_flags & BO_MAP_PERSISTENT) || (*map_data)->refcount == 1))
+		drv_bo_invalidate(bo, *map_data);
 	addr = (uint8_t *)((*map_data)->vma->addr);
 	addr += drv_bo_get_plane_offset(bo, plane);
 	pthread_mutex_unlock(&drv->mappings_lock);
@@ -626,6 +833,15 @@ bool drv_bo_cached(struct bo *bo)
 	return bo->meta.cached;
 }
 
+/*
+ * Whether a mapping of bo is a copy that only sees device writes made before drv_bo_map() and
+ * only writes back in drv_bo_unmap(). Such mappings cannot be kept across device accesses.
+ */
+bool drv_bo_map_copies(struct bo *bo)
+{
+	return bo->drv->backend->bo_map_copies;
+}
+
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret = 0;
@@ -674,6 +890,33 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	return ret;
 }
 
+int drv_bo_flush_or_unmap_fence(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	assert(!(bo->meta.use_flags & BO_USE_PROTECTED));
+
+	/* Backends without bo_flush write back on unmap, which cannot return a fence. */
+	if (!bo->drv->backend->bo_flush) {
+		*out_fence = -1;
+		return drv_bo_unmap(bo, mapping);
+	}
+
+	return drv_bo_flush_fence(bo, mapping, out_fence);
+}
+
+int drv_bo_flush_fence(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	assert(mapping);
+	assert(mapping->vma);
+	assert(mapping->refcount > 0);
+	assert(mapping->vma->refcount > 0);
+
+	*out_fence = -1;
+	if (bo->drv->backend->bo_flush_fence)
+		return bo->drv->backend->bo_flush_fence(bo, mapping, out_fence);
+
+	return drv_bo_flush(bo, mapping);
+}
+
 uint32_t drv_bo_get_width(struct bo *bo)
 {
 	return bo->meta.width;
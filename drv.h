@@ -54,6 +54,15 @@ extern "C" {
 #define BO_MAP_READ (1 << 0)
 #define BO_MAP_WRITE (1 << 1)
 #define BO_MAP_READ_WRITE (BO_MAP_READ | BO_MAP_WRITE)
+/* The mapping is kept for long; it is only invalidated when created or when
+ * the caller asks for it.  Not passed to the backends.
+ */
+#define BO_MAP_PERSISTENT (1 << 2)
+/* Skip the invalidate on map; the caller invalidates once the device is done
+ * with the buffer, e.g. when an acquire fence signals.  Not passed to the
+ * backends.
+ */
+#define BO_MAP_DEFER_INVALIDATE (1 << 3)
 
 /* This is our extension to <drm_fourcc.h>.  We need to make sure we don't step
  * on the namespace of already defined formats, which can be done by using invalid
@@ -147,6 +156,13 @@ struct drv_import_fd_data {
 	uint64_t use_flags;
 };
 
+struct rectangle {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
 struct vma {
 	void *addr;
 	size_t length;
@@ -155,16 +171,11 @@ struct vma {
 	uint32_t map_flags;
 	int32_t refcount;
 	uint32_t map_strides[DRV_MAX_PLANES];
+	/* region of the bo that is accessible through addr */
+	struct rectangle rect;
 	void *priv;
 };
 
-struct rectangle {
-	uint32_t x;
-	uint32_t y;
-	uint32_t width;
-	uint32_t height;
-};
-
 struct mapping {
 	struct vma *vma;
 	struct rectangle rect;
@@ -183,6 +194,8 @@ const char *drv_get_name(struct driver *drv);
 
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags);
 
+bool drv_has_combination(struct driver *drv, uint32_t format, uint64_t use_flags);
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags, bool is_test_buffer);
 
@@ -196,6 +209,9 @@ void drv_bo_destroy(struct bo *bo);
 
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data);
 
+int drv_bo_import_batch(struct driver *drv, struct drv_import_fd_data *data, size_t count,
+			struct bo **bos);
+
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane);
 
@@ -203,12 +219,18 @@ int drv_bo_unmap(struct bo *bo, struct mapping *mapping);
 
 bool drv_bo_cached(struct bo *bo);
 
+bool drv_bo_map_copies(struct bo *bo);
+
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_flush(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
 
+int drv_bo_flush_fence(struct bo *bo, struct mapping *mapping, int *out_fence);
+
+int drv_bo_flush_or_unmap_fence(struct bo *bo, struct mapping *mapping, int *out_fence);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
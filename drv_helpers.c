@@ -517,6 +517,7 @@ void drv_add_combination(struct driver *drv, const uint32_t format,
 				     .use_flags = use_flags };
 
 	drv_array_append(drv->combos, &combo);
+	drv->format_table_stale = true;
 }
 
 void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
@@ -531,6 +532,8 @@ void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t
 
 		drv_array_append(drv->combos, &combo);
 	}
+
+	drv->format_table_stale = true;
 }
 
 void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
@@ -545,6 +548,8 @@ void drv_modify_combination(struct driver *drv, uint32_t format, struct format_m
 		    combo->metadata.modifier == metadata->modifier)
 			combo->use_flags |= use_flags;
 	}
+
+	drv->format_table_stale = true;
 }
 
 int drv_modify_linear_combinations(struct driver *drv)
@@ -72,6 +72,10 @@ struct driver {
 	pthread_mutex_t mappings_lock;
 	struct drv_array *mappings;
 	struct drv_array *combos;
+	/* combos flattened and sorted by format, see drv_has_combination */
+	struct format_support *format_table;
+	uint32_t format_table_size;
+	bool format_table_stale;
 	bool compression;
 	bool log_bos;
 };
@@ -98,9 +102,19 @@ struct backend {
 	int (*bo_destroy)(struct bo *bo);
 	int (*bo_import)(struct bo *bo, struct drv_import_fd_data *data);
 	void *(*bo_map)(struct bo *bo, struct vma *vma, uint32_t map_flags);
+	/* Like bo_map, but may map only rect.  It must then shrink vma->rect. */
+	void *(*bo_map_rect)(struct bo *bo, struct vma *vma, const struct rectangle *rect,
+			     uint32_t map_flags);
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
+	/*
+	 * Set when bo_map copies the bo into a staging buffer and bo_unmap copies it back, so that
+	 * bo_invalidate/bo_flush cannot make a mapping coherent while it stays mapped.
+	 */
+	bool bo_map_copies;
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	/* Like bo_flush, but may return a fence instead of waiting */
+	int (*bo_flush_fence)(struct bo *bo, struct mapping *mapping, int *out_fence);
 	int (*bo_get_plane_fd)(struct bo *bo, size_t plane);
 	uint32_t (*bo_get_map_stride)(struct bo *bo);
 	void (*resolve_format_and_use_flags)(struct driver *drv, uint32_t format,
@@ -5,6 +5,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -38,7 +39,7 @@ PUBLIC int gbm_device_is_format_supported(struct gbm_device *gbm, uint32_t forma
 
 	use_flags = gbm_convert_usage(usage);
 
-	return (drv_get_combination(gbm->drv, format, use_flags) != NULL);
+	return drv_has_combination(gbm->drv, format, use_flags);
 }
 
 PUBLIC int gbm_device_get_format_modifier_plane_count(struct gbm_device *gbm, uint32_t format,
@@ -71,17 +72,67 @@ PUBLIC void gbm_device_destroy(struct gbm_device *gbm)
 	free(gbm);
 }
 
-PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
-					      uint32_t height, uint32_t format, uint32_t usage)
+static void gbm_surface_free(struct gbm_surface *surface)
 {
-	struct gbm_surface *surface = (struct gbm_surface *)malloc(sizeof(*surface));
+	for (size_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->buffers[i].bo)
+			gbm_bo_destroy(surface->buffers[i].bo);
+	}
+
+	pthread_mutex_destroy(&surface->lock);
+	free(surface);
+}
+
+/*
+ * All buffers are allocated up front, so that presenting frames does not
+ * allocate. With modifiers, the first buffer picks the modifier and the rest
+ * are allocated with the same one.
+ */
+static struct gbm_surface *gbm_surface_alloc(struct gbm_device *gbm, uint32_t width,
+					     uint32_t height, uint32_t format, uint32_t usage,
+					     const uint64_t *modifiers, unsigned int count)
+{
+	struct gbm_surface *surface = (struct gbm_surface *)calloc(1, sizeof(*surface));
+	uint64_t modifier = DRM_FORMAT_MOD_INVALID;
 
 	if (!surface)
 		return NULL;
 
+	pthread_mutex_init(&surface->lock, NULL);
+
+	for (size_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		struct gbm_bo *bo;
+
+		if (!count)
+			bo = gbm_bo_create(gbm, width, height, format, usage);
+		else if (!i)
+			bo = gbm_bo_create_with_modifiers2(gbm, width, height, format, modifiers,
+							   count, 0);
+		else
+			bo = gbm_bo_create_with_modifiers2(gbm, width, height, format, &modifier,
+							   1, 0);
+
+		if (!bo) {
+			gbm_surface_free(surface);
+			return NULL;
+		}
+
+		if (!i)
+			modifier = gbm_bo_get_modifier(bo);
+
+		surface->buffers[i].bo = bo;
+		surface->buffers[i].state = GBM_SURFACE_BUFFER_FREE;
+	}
+
 	return surface;
 }
 
+PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
+					      uint32_t height, uint32_t format, uint32_t usage)
+{
+	return gbm_surface_alloc(gbm, width, height, format, usage, NULL, 0);
+}
+
 PUBLIC struct gbm_surface *gbm_surface_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 							     uint32_t height, uint32_t format,
 							     const uint64_t *modifiers,
@@ -95,32 +146,111 @@ gbm_surface_create_with_modifiers2(struct gbm_device *gbm, uint32_t width, uint3
 				   uint32_t format, const uint64_t *modifiers,
 				   const unsigned int count, uint32_t flags)
 {
-	if (count != 0 || modifiers != NULL)
+	if ((count != 0) != (modifiers != NULL))
 		return NULL;
 
+	/* gbm_bo_create_with_modifiers2 does not support flags either */
 	if (flags != 0)
 		return NULL;
 
-	return gbm_surface_create(gbm, width, height, format, flags);
+	return gbm_surface_alloc(gbm, width, height, format, flags, modifiers, count);
 }
 
-PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
+static struct gbm_surface_buffer *gbm_surface_find_buffer(struct gbm_surface *surface,
+							  struct gbm_bo *bo)
 {
+	for (size_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->buffers[i].bo == bo)
+			return &surface->buffers[i];
+	}
+
 	return NULL;
 }
 
+/* Returns the buffer in the given state that was queued the longest time ago. */
+static struct gbm_surface_buffer *gbm_surface_oldest_buffer(struct gbm_surface *surface,
+							    enum gbm_surface_buffer_state state)
+{
+	struct gbm_surface_buffer *oldest = NULL;
+
+	for (size_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		struct gbm_surface_buffer *buffer = &surface->buffers[i];
+		if (buffer->state == state && (!oldest || buffer->seq < oldest->seq))
+			oldest = buffer;
+	}
+
+	return oldest;
+}
+
+PUBLIC struct gbm_bo *gbm_surface_dequeue_buffer(struct gbm_surface *surface)
+{
+	struct gbm_surface_buffer *buffer;
+
+	pthread_mutex_lock(&surface->lock);
+	buffer = gbm_surface_oldest_buffer(surface, GBM_SURFACE_BUFFER_FREE);
+	if (buffer)
+		buffer->state = GBM_SURFACE_BUFFER_DEQUEUED;
+	pthread_mutex_unlock(&surface->lock);
+
+	return buffer ? buffer->bo : NULL;
+}
+
+PUBLIC int gbm_surface_queue_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
+{
+	struct gbm_surface_buffer *buffer;
+	int ret = 0;
+
+	pthread_mutex_lock(&surface->lock);
+	buffer = gbm_surface_find_buffer(surface, bo);
+	if (buffer && buffer->state == GBM_SURFACE_BUFFER_DEQUEUED) {
+		buffer->state = GBM_SURFACE_BUFFER_QUEUED;
+		buffer->seq = ++surface->seq;
+	} else {
+		ret = -EINVAL;
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return ret;
+}
+
+PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
+{
+	struct gbm_surface_buffer *buffer;
+
+	pthread_mutex_lock(&surface->lock);
+	buffer = gbm_surface_oldest_buffer(surface, GBM_SURFACE_BUFFER_QUEUED);
+	if (buffer)
+		buffer->state = GBM_SURFACE_BUFFER_LOCKED;
+	pthread_mutex_unlock(&surface->lock);
+
+	return buffer ? buffer->bo : NULL;
+}
+
 PUBLIC void gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
 {
+	struct gbm_surface_buffer *buffer;
+
+	pthread_mutex_lock(&surface->lock);
+	buffer = gbm_surface_find_buffer(surface, bo);
+	if (buffer && buffer->state == GBM_SURFACE_BUFFER_LOCKED)
+		buffer->state = GBM_SURFACE_BUFFER_FREE;
+	pthread_mutex_unlock(&surface->lock);
 }
 
 PUBLIC int gbm_surface_has_free_buffers(struct gbm_surface *surface)
 {
-	return 0;
+	int has_free;
+
+	pthread_mutex_lock(&surface->lock);
+	has_free = gbm_surface_oldest_buffer(surface, GBM_SURFACE_BUFFER_FREE) != NULL;
+	pthread_mutex_unlock(&surface->lock);
+
+	return has_free;
 }
 
 PUBLIC void gbm_surface_destroy(struct gbm_surface *surface)
 {
-	free(surface);
+	gbm_surface_free(surface);
 }
 
 static struct gbm_bo *gbm_bo_new(struct gbm_device *gbm, uint32_t format)
@@ -215,6 +345,39 @@ PUBLIC void gbm_bo_destroy(struct gbm_bo *bo)
 	free(bo);
 }
 
+static int gbm_import_fd_modifier_to_drv(struct gbm_device *gbm,
+					 const struct gbm_import_fd_modifier_data *fd_modifier_data,
+					 struct drv_import_fd_data *drv_data)
+{
+	size_t num_planes, i, num_fds;
+
+	drv_data->width = fd_modifier_data->width;
+	drv_data->height = fd_modifier_data->height;
+	drv_data->format = fd_modifier_data->format;
+	num_planes = drv_num_planes_from_modifier(gbm->drv, drv_data->format,
+						  fd_modifier_data->modifier);
+	assert(num_planes);
+
+	num_fds = fd_modifier_data->num_fds;
+	if (!num_fds || num_fds > num_planes)
+		return -EINVAL;
+
+	drv_data->format_modifier = fd_modifier_data->modifier;
+	for (i = 0; i < num_planes; i++) {
+		if (num_fds != num_planes)
+			drv_data->fds[i] = fd_modifier_data->fds[0];
+		else
+			drv_data->fds[i] = fd_modifier_data->fds[i];
+		drv_data->offsets[i] = fd_modifier_data->offsets[i];
+		drv_data->strides[i] = fd_modifier_data->strides[i];
+	}
+
+	for (i = num_planes; i < GBM_MAX_PLANES; i++)
+		drv_data->fds[i] = -1;
+
+	return 0;
+}
+
 PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void *buffer,
 				    uint32_t usage)
 {
@@ -223,7 +386,6 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	struct gbm_import_fd_data *fd_data = buffer;
 	struct gbm_import_fd_modifier_data *fd_modifier_data = buffer;
 	uint32_t gbm_format;
-	size_t num_planes, i, num_fds;
 
 	drv_data.use_flags = gbm_convert_usage(usage);
 	switch (type) {
@@ -239,30 +401,9 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 		break;
 	case GBM_BO_IMPORT_FD_MODIFIER:
 		gbm_format = fd_modifier_data->format;
-		drv_data.width = fd_modifier_data->width;
-		drv_data.height = fd_modifier_data->height;
-		drv_data.format = fd_modifier_data->format;
-		num_planes = drv_num_planes_from_modifier(gbm->drv, drv_data.format,
-							  fd_modifier_data->modifier);
-		assert(num_planes);
-
-		num_fds = fd_modifier_data->num_fds;
-		if (!num_fds || num_fds > num_planes)
+		if (gbm_import_fd_modifier_to_drv(gbm, fd_modifier_data, &drv_data))
 			return NULL;
 
-		drv_data.format_modifier = fd_modifier_data->modifier;
-		for (i = 0; i < num_planes; i++) {
-			if (num_fds != num_planes)
-				drv_data.fds[i] = fd_modifier_data->fds[0];
-			else
-				drv_data.fds[i] = fd_modifier_data->fds[i];
-			drv_data.offsets[i] = fd_modifier_data->offsets[i];
-			drv_data.strides[i] = fd_modifier_data->strides[i];
-		}
-
-		for (i = num_planes; i < GBM_MAX_PLANES; i++)
-			drv_data.fds[i] = -1;
-
 		break;
 	default:
 		return NULL;
@@ -286,6 +427,69 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	return bo;
 }
 
+PUBLIC int gbm_bo_import_batch(struct gbm_device *gbm,
+				const struct gbm_import_fd_modifier_data *buffers, uint32_t count,
+				uint32_t usage, struct gbm_bo **bos)
+{
+	struct drv_import_fd_data *drv_data;
+	struct bo **drv_bos;
+	uint32_t checked_format = DRM_FORMAT_INVALID;
+	uint32_t i;
+	int ret = 0;
+
+	if (!count)
+		return 0;
+
+	memset(bos, 0, count * sizeof(*bos));
+	drv_data = calloc(count, sizeof(*drv_data));
+	drv_bos = calloc(count, sizeof(*drv_bos));
+	if (!drv_data || !drv_bos) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* Swapchain buffers share a format, so it is usually only checked once. */
+		if (buffers[i].format != checked_format) {
+			if (!gbm_device_is_format_supported(gbm, buffers[i].format, usage)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			checked_format = buffers[i].format;
+		}
+
+		drv_data[i].use_flags = gbm_convert_usage(usage);
+		ret = gbm_import_fd_modifier_to_drv(gbm, &buffers[i], &drv_data[i]);
+		if (ret)
+			goto out;
+
+		bos[i] = gbm_bo_new(gbm, buffers[i].format);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ret = drv_bo_import_batch(gbm->drv, drv_data, count, drv_bos);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++)
+		bos[i]->bo = drv_bos[i];
+
+out:
+	if (ret) {
+		for (i = 0; i < count; i++) {
+			free(bos[i]);
+			bos[i] = NULL;
+		}
+	}
+
+	free(drv_bos);
+	free(drv_data);
+	return ret;
+}
+
 PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 			uint32_t transfer_flags, uint32_t *stride, void **map_data)
 {
@@ -301,10 +505,32 @@ PUBLIC enum gbm_bo_map_cache_mode gbm_bo_get_map_info(struct gbm_bo *bo)
 
 PUBLIC void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
 {
+	struct mapping *mapping = (struct mapping *)map_data;
+
 	assert(bo);
+	if (mapping->vma->map_flags & BO_MAP_PERSISTENT) {
+		/* the end of a persistent mapping is rare enough to flush unconditionally */
+		if (mapping->vma->map_flags & BO_MAP_WRITE)
+			drv_bo_flush(bo->bo, mapping);
+		drv_bo_unmap(bo->bo, mapping);
+		return;
+	}
+
 	drv_bo_flush_or_unmap(bo->bo, map_data);
 }
 
+PUBLIC int gbm_bo_invalidate(struct gbm_bo *bo, void *map_data)
+{
+	assert(bo);
+	return drv_bo_invalidate(bo->bo, map_data);
+}
+
+PUBLIC int gbm_bo_flush(struct gbm_bo *bo, void *map_data)
+{
+	assert(bo);
+	return drv_bo_flush(bo->bo, map_data);
+}
+
 PUBLIC uint32_t gbm_bo_get_width(struct gbm_bo *bo)
 {
 	return drv_bo_get_width(bo->bo);
@@ -447,6 +673,11 @@ PUBLIC void *gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t wid
 
 	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
 	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_PERSISTENT) ? BO_MAP_PERSISTENT : BO_MAP_NONE;
+
+	/* gbm_bo_invalidate and gbm_bo_flush could not keep such a mapping coherent */
+	if ((map_flags & BO_MAP_PERSISTENT) && drv_bo_map_copies(bo->bo))
+		return MAP_FAILED;
 
 	addr = drv_bo_map(bo->bo, &rect, map_flags, (struct mapping **)map_data, plane);
 	if (addr == MAP_FAILED)
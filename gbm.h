@@ -557,6 +557,56 @@ gbm_bo_map2(struct gbm_bo *bo,
 	   uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 	   uint32_t flags, uint32_t *stride, void **map_data, int plane);
 
+/*
+ * Producer side of gbm_surface. In Mesa, the EGL platform fills and queues
+ * the surface buffers during eglSwapBuffers. minigbm has no EGL platform, so
+ * producers dequeue a free buffer, render into it, and queue it for
+ * gbm_surface_lock_front_buffer.
+ */
+#define MINIGBM_HAS_GBM_SURFACE_QUEUE
+
+/*
+ * minigbm extension to enum gbm_bo_transfer_flags, on a high bit so that it
+ * does not collide with flags Mesa may add. The mapping is kept for the
+ * lifetime of the client's use. Mapping it again does not re-read the buffer
+ * contents, and gbm_bo_unmap is the only implicit flush. Use
+ * gbm_bo_invalidate and gbm_bo_flush around CPU access instead. Mapping fails
+ * on backends that map through a staging copy, which cannot be kept coherent.
+ */
+#define GBM_BO_TRANSFER_PERSISTENT (1 << 30)
+
+/*
+ * Cache maintenance for mappings created with GBM_BO_TRANSFER_PERSISTENT.
+ * gbm_bo_invalidate makes device writes visible to the mapping, gbm_bo_flush
+ * makes CPU writes through the mapping visible to the device.
+ */
+#define MINIGBM_HAS_GBM_BO_FLUSH
+
+int
+gbm_bo_invalidate(struct gbm_bo *bo, void *map_data);
+
+int
+gbm_bo_flush(struct gbm_bo *bo, void *map_data);
+
+struct gbm_bo *
+gbm_surface_dequeue_buffer(struct gbm_surface *surface);
+
+int
+gbm_surface_queue_buffer(struct gbm_surface *surface, struct gbm_bo *bo);
+
+/*
+ * Imports count GBM_BO_IMPORT_FD_MODIFIER descriptors in one call, e.g. all
+ * buffers of a client swapchain. Format checks and dma-buf fd lookups are
+ * shared between the buffers. Returns 0 and fills bos, or a negative errno
+ * and imports nothing.
+ */
+#define MINIGBM_HAS_GBM_BO_IMPORT_BATCH
+
+int
+gbm_bo_import_batch(struct gbm_device *gbm,
+                    const struct gbm_import_fd_modifier_data *buffers,
+                    uint32_t count, uint32_t usage, struct gbm_bo **bos);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,6 +7,7 @@
 #ifndef GBM_PRIV_H
 #define GBM_PRIV_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,7 +19,29 @@ struct gbm_device {
 	struct driver *drv;
 };
 
+#define GBM_SURFACE_NUM_BUFFERS 4
+
+enum gbm_surface_buffer_state {
+	GBM_SURFACE_BUFFER_FREE,
+	/* owned by the producer, see gbm_surface_dequeue_buffer */
+	GBM_SURFACE_BUFFER_DEQUEUED,
+	/* waiting for gbm_surface_lock_front_buffer */
+	GBM_SURFACE_BUFFER_QUEUED,
+	/* owned by the consumer until gbm_surface_release_buffer */
+	GBM_SURFACE_BUFFER_LOCKED,
+};
+
+struct gbm_surface_buffer {
+	struct gbm_bo *bo;
+	enum gbm_surface_buffer_state state;
+	/* when the buffer was last queued, for FIFO order and LRU reuse */
+	uint64_t seq;
+};
+
 struct gbm_surface {
+	pthread_mutex_t lock;
+	struct gbm_surface_buffer buffers[GBM_SURFACE_NUM_BUFFERS];
+	uint64_t seq;
 };
 
 struct gbm_bo {
@@ -6,11 +6,30 @@
  */
 
 #include <drm/drm_fourcc.h>
+#include <fcntl.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <xf86drm.h>
+#include <xf86drmMode.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "external/virtgpu_cross_domain_protocol.h"
+#include "external/virtgpu_drm.h"
 #include "gbm.h"
+#include "minigbm_helpers.h"
 
 class MockDrm
 {
@@ -19,11 +38,164 @@ class MockDrm
 	MOCK_METHOD(void, drmFreeVersion, (drmVersionPtr v));
 };
 
+/*
+ * Fake virtio-gpu device exposing a cross-domain context. The metadata query ring is a memfd
+ * shared between minigbm and the fake host, and each GET_IMAGE_REQUIREMENTS answer is delayed by
+ * query_latency to emulate a slow host round trip. With hold_queries set, answers are held back
+ * until ReleaseQueries() is called.
+ */
+class FakeVirtGpu
+{
+      public:
+	FakeVirtGpu()
+	{
+		fd = memfd_create("fake-virtgpu", MFD_CLOEXEC);
+		EXPECT_EQ(ftruncate(fd, 4096), 0);
+		ring = static_cast<uint32_t *>(
+		    mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+	}
+
+	~FakeVirtGpu()
+	{
+		munmap(ring, 4096);
+		close(fd);
+	}
+
+	int Ioctl(unsigned long request, void *arg)
+	{
+		switch (request) {
+		case DRM_IOCTL_VIRTGPU_GETPARAM: {
+			auto *get_param = static_cast<struct drm_virtgpu_getparam *>(arg);
+			uint32_t value = 0;
+
+			if (get_param->param == VIRTGPU_PARAM_CONTEXT_INIT ||
+			    get_param->param == VIRTGPU_PARAM_RESOURCE_BLOB ||
+			    get_param->param == VIRTGPU_PARAM_HOST_VISIBLE)
+				value = 1;
+			else if (get_param->param == VIRTGPU_PARAM_SUPPORTED_CAPSET_IDs)
+				value = 1 << 5; // VIRTIO_GPU_CAPSET_CROSS_DOMAIN
+			else if (get_param->param == VIRTGPU_PARAM_GUEST_VRAM)
+				value = guest_vram;
+
+			*reinterpret_cast<uint32_t *>(get_param->value) = value;
+			return 0;
+		}
+		case DRM_IOCTL_VIRTGPU_GET_CAPS: {
+			auto *args = static_cast<struct drm_virtgpu_get_caps *>(arg);
+			auto *caps = reinterpret_cast<struct CrossDomainCapabilities *>(args->addr);
+
+			caps_queries++;
+			memset(caps, 0, args->size);
+			caps->version = 1;
+			caps->supports_dmabuf = 1;
+			caps->supports_external_gpu_memory = 1;
+			return 0;
+		}
+		case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB: {
+			auto *blob = static_cast<struct drm_virtgpu_resource_create_blob *>(arg);
+
+			blob->bo_handle = next_handle++;
+			blob->res_handle = blob->bo_handle;
+			blobs++;
+			return 0;
+		}
+		case DRM_IOCTL_PRIME_FD_TO_HANDLE: {
+			auto *prime = static_cast<struct drm_prime_handle *>(arg);
+			struct stat sb;
+
+			if (fstat(prime->fd, &sb))
+				return -1;
+
+			// Like the kernel, the same dma-buf always resolves to the same handle.
+			prime->handle = static_cast<uint32_t>(sb.st_ino);
+			prime_imports++;
+			return 0;
+		}
+		case DRM_IOCTL_VIRTGPU_MAP:
+			static_cast<struct drm_virtgpu_map *>(arg)->offset = 0;
+			return 0;
+		case DRM_IOCTL_VIRTGPU_EXECBUFFER:
+			return Execbuffer(static_cast<struct drm_virtgpu_execbuffer *>(arg));
+		case DRM_IOCTL_VIRTGPU_CONTEXT_INIT:
+		case DRM_IOCTL_VIRTGPU_WAIT:
+		case DRM_IOCTL_GEM_CLOSE:
+			return 0;
+		default:
+			errno = ENOTTY;
+			return -1;
+		}
+	}
+
+	void ReleaseQueries()
+	{
+		std::lock_guard<std::mutex> lock(hold_mutex_);
+		hold_queries = false;
+		hold_cv_.notify_all();
+	}
+
+	int fd = -1;
+	std::chrono::milliseconds query_latency{ 0 };
+	bool hold_queries = false;
+	std::atomic<int> queries{ 0 };
+	std::atomic<int> queries_in_flight{ 0 };
+	std::atomic<int> blobs{ 0 };
+	std::atomic<int> prime_imports{ 0 };
+	std::atomic<int> caps_queries{ 0 };
+	/* Reported as VIRTGPU_PARAM_GUEST_VRAM, to emulate a change of host features. */
+	uint32_t guest_vram = 0;
+
+      private:
+	int Execbuffer(struct drm_virtgpu_execbuffer *exec)
+	{
+		auto *hdr = reinterpret_cast<struct CrossDomainHeader *>(exec->command);
+		if (hdr->cmd != CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS)
+			return 0;
+
+		auto *cmd = reinterpret_cast<struct CrossDomainGetImageRequirements *>(hdr);
+		struct CrossDomainImageRequirements reqs = {};
+
+		queries_in_flight++;
+		queries++;
+		std::this_thread::sleep_for(query_latency);
+		{
+			std::unique_lock<std::mutex> lock(hold_mutex_);
+			hold_cv_.wait(lock, [this] { return !hold_queries; });
+		}
+
+		reqs.strides[0] = cmd->width * 4;
+		reqs.size = reqs.strides[0] * cmd->height;
+		reqs.blob_id = queries;
+		memcpy(ring, &reqs, sizeof(reqs));
+		queries_in_flight--;
+
+		return 0;
+	}
+
+	uint32_t *ring = nullptr;
+	std::atomic<uint32_t> next_handle{ 1 };
+	std::mutex hold_mutex_;
+	std::condition_variable hold_cv_;
+};
+
+static FakeVirtGpu *fake_virtgpu;
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	if (fake_virtgpu && fd == fake_virtgpu->fd)
+		return fake_virtgpu->Ioctl(request, arg);
+
+	errno = ENOTTY;
+	return -1;
+}
+
 // Define a mock version of drmGetVersion
 drmVersionPtr drmGetVersion(int fd)
 {
 	drmVersionPtr mock_version = new drmVersion();
-	mock_version->name = "Mock Backend";
+	if (fake_virtgpu && fd == fake_virtgpu->fd)
+		mock_version->name = "virtio_gpu";
+	else
+		mock_version->name = "Mock Backend";
 	return mock_version;
 }
 
@@ -33,6 +205,56 @@ void drmFreeVersion(drmVersionPtr v)
 	delete (v);
 }
 
+/*
+ * Fake KMS connector state for the connector monitor tests. Every drmModeGetConnector call is
+ * counted so tests can tell a cached answer from a re-probe.
+ */
+struct FakeKms {
+	int fd = -1;
+	std::vector<drmModeConnection> connections;
+	std::vector<uint32_t> ids;
+	std::atomic<int> connector_queries{ 0 };
+};
+
+static FakeKms *fake_kms;
+
+drmModeResPtr drmModeGetResources(int fd)
+{
+	if (!fake_kms || fd != fake_kms->fd)
+		return nullptr;
+
+	fake_kms->ids.resize(fake_kms->connections.size());
+	for (size_t i = 0; i < fake_kms->ids.size(); i++)
+		fake_kms->ids[i] = i;
+
+	auto *res = new drmModeRes();
+	res->count_connectors = fake_kms->ids.size();
+	res->connectors = fake_kms->ids.data();
+	return res;
+}
+
+void drmModeFreeResources(drmModeResPtr ptr)
+{
+	delete ptr;
+}
+
+drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connector_id)
+{
+	if (!fake_kms || fd != fake_kms->fd || connector_id >= fake_kms->connections.size())
+		return nullptr;
+
+	fake_kms->connector_queries++;
+	auto *conn = new drmModeConnector();
+	conn->connector_id = connector_id;
+	conn->connection = fake_kms->connections[connector_id];
+	return conn;
+}
+
+void drmModeFreeConnector(drmModeConnectorPtr ptr)
+{
+	delete ptr;
+}
+
 /* TODO : This is a protocol to add unit tests for the public APIs in minigbm.
  *
  * The ultimate goal would be cover more APIs and the input combinations.
@@ -80,3 +302,681 @@ TEST(gbm_unit_test, valid_backend_name)
 
 	gbm_device_destroy(gbm_device);
 }
+
+class gbm_cross_domain_test : public testing::Test
+{
+      protected:
+	void SetUp() override
+	{
+		fake_virtgpu = &fake_;
+		gbm_ = gbm_create_device(fake_.fd);
+		ASSERT_TRUE(gbm_);
+		ASSERT_STREQ(gbm_device_get_backend_name(gbm_), "virtgpu_cross_domain");
+	}
+
+	void TearDown() override
+	{
+		if (gbm_)
+			gbm_device_destroy(gbm_);
+		fake_virtgpu = nullptr;
+	}
+
+	struct gbm_bo *CreateBo(uint32_t width, uint32_t height)
+	{
+		return gbm_bo_create(gbm_, width, height, GBM_FORMAT_XRGB8888,
+				     GBM_BO_USE_RENDERING);
+	}
+
+	FakeVirtGpu fake_;
+	struct gbm_device *gbm_ = nullptr;
+};
+
+TEST_F(gbm_cross_domain_test, concurrent_identical_queries_are_deduplicated)
+{
+	std::vector<std::thread> threads;
+	struct gbm_bo *bos[8] = {};
+
+	fake_.query_latency = std::chrono::milliseconds(50);
+	for (auto &bo : bos)
+		threads.emplace_back([&] { bo = CreateBo(640, 480); });
+	for (auto &thread : threads)
+		thread.join();
+
+	EXPECT_EQ(fake_.queries, 1);
+	for (auto bo : bos) {
+		ASSERT_TRUE(bo);
+		EXPECT_EQ(gbm_bo_get_stride(bo), 640u * 4);
+		gbm_bo_destroy(bo);
+	}
+}
+
+TEST_F(gbm_cross_domain_test, distinct_queries_get_their_own_answers)
+{
+	std::vector<std::thread> threads;
+	struct gbm_bo *bos[4] = {};
+
+	fake_.query_latency = std::chrono::milliseconds(10);
+	for (uint32_t i = 0; i < 4; i++)
+		threads.emplace_back([&, i] { bos[i] = CreateBo(64 * (i + 1), 64); });
+	for (auto &thread : threads)
+		thread.join();
+
+	EXPECT_EQ(fake_.queries, 4);
+	for (uint32_t i = 0; i < 4; i++) {
+		ASSERT_TRUE(bos[i]);
+		EXPECT_EQ(gbm_bo_get_stride(bos[i]), 64u * (i + 1) * 4);
+		gbm_bo_destroy(bos[i]);
+	}
+}
+
+TEST_F(gbm_cross_domain_test, cached_query_does_not_wait_for_slow_host)
+{
+	struct gbm_bo *cached = CreateBo(320, 240);
+	struct gbm_bo *slow = nullptr;
+
+	ASSERT_TRUE(cached);
+	gbm_bo_destroy(cached);
+	EXPECT_EQ(fake_.queries, 1);
+
+	fake_.hold_queries = true;
+	std::thread slow_thread([&] { slow = CreateBo(1920, 1080); });
+	while (!fake_.queries_in_flight)
+		std::this_thread::yield();
+
+	// The host can't answer until released, so the cached bo must not need a round trip. The
+	// timeout only keeps a regression from hanging the test.
+	auto cached_future = std::async(std::launch::async, [&] { return CreateBo(320, 240); });
+	bool completed =
+	    cached_future.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+	EXPECT_TRUE(completed);
+	EXPECT_EQ(fake_.queries_in_flight, 1);
+	EXPECT_EQ(fake_.queries, 2);
+
+	fake_.ReleaseQueries();
+	cached = cached_future.get();
+	slow_thread.join();
+
+	EXPECT_EQ(fake_.queries, 2);
+	ASSERT_TRUE(cached);
+	ASSERT_TRUE(slow);
+	EXPECT_EQ(gbm_bo_get_stride(slow), 1920u * 4);
+	gbm_bo_destroy(cached);
+	gbm_bo_destroy(slow);
+}
+
+TEST_F(gbm_cross_domain_test, capset_cache_hit_miss_and_invalidation)
+{
+	char dir[] = "/tmp/minigbm_capset_cache_XXXXXX";
+	ASSERT_TRUE(mkdtemp(dir));
+	const int initial_queries = fake_.caps_queries;
+
+	setenv("MINIGBM_VIRTGPU_CAPSET_CACHE_DIR", dir, 1);
+
+	// The first device misses and stores the capset, the second one is served from disk.
+	struct gbm_device *first = gbm_create_device(fake_.fd);
+	ASSERT_TRUE(first);
+	EXPECT_EQ(fake_.caps_queries, initial_queries + 1);
+	struct gbm_device *second = gbm_create_device(fake_.fd);
+	ASSERT_TRUE(second);
+	EXPECT_EQ(fake_.caps_queries, initial_queries + 1);
+	EXPECT_STREQ(gbm_device_get_backend_name(second), "virtgpu_cross_domain");
+
+	// A change of the params reported by the host invalidates the entry.
+	fake_.guest_vram = 1;
+	struct gbm_device *third = gbm_create_device(fake_.fd);
+	ASSERT_TRUE(third);
+	EXPECT_EQ(fake_.caps_queries, initial_queries + 2);
+
+	unsetenv("MINIGBM_VIRTGPU_CAPSET_CACHE_DIR");
+	gbm_device_destroy(first);
+	gbm_device_destroy(second);
+	gbm_device_destroy(third);
+
+	std::string entry = std::string(dir) + "/minigbm_capset_5.bin";
+	EXPECT_EQ(unlink(entry.c_str()), 0);
+	EXPECT_EQ(rmdir(dir), 0);
+}
+
+using gbm_surface_test = gbm_cross_domain_test;
+
+TEST_F(gbm_surface_test, buffers_are_recycled_across_frames)
+{
+	struct gbm_surface *surface = gbm_surface_create(gbm_, 640, 480, GBM_FORMAT_XRGB8888,
+							 GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+	ASSERT_TRUE(surface);
+	EXPECT_TRUE(gbm_surface_has_free_buffers(surface));
+	EXPECT_FALSE(gbm_surface_lock_front_buffer(surface));
+
+	const int blobs = fake_.blobs;
+	std::set<struct gbm_bo *> seen;
+	struct gbm_bo *front = nullptr;
+
+	for (int frame = 0; frame < 5000; frame++) {
+		struct gbm_bo *back = gbm_surface_dequeue_buffer(surface);
+		ASSERT_TRUE(back);
+		EXPECT_NE(back, front);
+		seen.insert(back);
+
+		ASSERT_EQ(gbm_surface_queue_buffer(surface, back), 0);
+		struct gbm_bo *locked = gbm_surface_lock_front_buffer(surface);
+		ASSERT_EQ(locked, back);
+
+		// Like a compositor, keep scanning out the previous frame until the
+		// new one is locked.
+		if (front)
+			gbm_surface_release_buffer(surface, front);
+		front = locked;
+	}
+
+	EXPECT_EQ(fake_.blobs, blobs);
+	EXPECT_LE(seen.size(), 4u);
+
+	gbm_surface_release_buffer(surface, front);
+	gbm_surface_destroy(surface);
+}
+
+TEST_F(gbm_surface_test, queue_depth_is_bounded)
+{
+	struct gbm_surface *surface =
+	    gbm_surface_create(gbm_, 64, 64, GBM_FORMAT_XRGB8888, GBM_BO_USE_RENDERING);
+	ASSERT_TRUE(surface);
+
+	std::vector<struct gbm_bo *> bos;
+	while (struct gbm_bo *bo = gbm_surface_dequeue_buffer(surface))
+		bos.push_back(bo);
+	ASSERT_FALSE(bos.empty());
+	EXPECT_FALSE(gbm_surface_has_free_buffers(surface));
+
+	// Queued buffers are locked in FIFO order.
+	for (struct gbm_bo *bo : bos)
+		ASSERT_EQ(gbm_surface_queue_buffer(surface, bo), 0);
+	EXPECT_NE(gbm_surface_queue_buffer(surface, bos[0]), 0);
+	for (struct gbm_bo *bo : bos)
+		EXPECT_EQ(gbm_surface_lock_front_buffer(surface), bo);
+	EXPECT_FALSE(gbm_surface_lock_front_buffer(surface));
+
+	gbm_surface_release_buffer(surface, bos[1]);
+	EXPECT_TRUE(gbm_surface_has_free_buffers(surface));
+	EXPECT_EQ(gbm_surface_dequeue_buffer(surface), bos[1]);
+
+	gbm_surface_destroy(surface);
+}
+
+TEST_F(gbm_cross_domain_test, format_support_matches_combinations)
+{
+	const uint32_t bogus_format = 0x5a5a5a5a;
+
+	for (int i = 0; i < 2; i++) {
+		EXPECT_TRUE(gbm_device_is_format_supported(gbm_, GBM_FORMAT_XRGB8888,
+							   GBM_BO_USE_RENDERING));
+		EXPECT_TRUE(gbm_device_is_format_supported(gbm_, GBM_FORMAT_XRGB8888,
+							   GBM_BO_USE_TEXTURING));
+		EXPECT_FALSE(gbm_device_is_format_supported(
+		    gbm_, GBM_FORMAT_XRGB8888, GBM_BO_USE_CURSOR | GBM_BO_USE_RENDERING));
+		EXPECT_FALSE(
+		    gbm_device_is_format_supported(gbm_, bogus_format, GBM_BO_USE_RENDERING));
+	}
+}
+
+TEST_F(gbm_cross_domain_test, persistent_mapping_is_reused)
+{
+	struct gbm_bo *bo = gbm_bo_create(gbm_, 16, 16, GBM_FORMAT_XRGB8888, GBM_BO_USE_LINEAR);
+	ASSERT_TRUE(bo);
+
+	const uint32_t flags = GBM_BO_TRANSFER_READ_WRITE | GBM_BO_TRANSFER_PERSISTENT;
+	uint32_t stride;
+	void *map_data;
+	void *addr = gbm_bo_map(bo, 0, 0, 16, 16, flags, &stride, &map_data);
+	ASSERT_NE(addr, MAP_FAILED);
+	ASSERT_TRUE(addr);
+
+	memset(addr, 0xab, stride * 16);
+	EXPECT_EQ(gbm_bo_flush(bo, map_data), 0);
+	EXPECT_EQ(gbm_bo_invalidate(bo, map_data), 0);
+
+	// Mapping again hands back the same mapping.
+	uint32_t again_stride;
+	void *again_data;
+	void *again = gbm_bo_map(bo, 0, 0, 16, 16, flags, &again_stride, &again_data);
+	EXPECT_EQ(again, addr);
+	EXPECT_EQ(again_data, map_data);
+	EXPECT_EQ(static_cast<uint8_t *>(again)[0], 0xab);
+
+	gbm_bo_unmap(bo, again_data);
+	gbm_bo_unmap(bo, map_data);
+	gbm_bo_destroy(bo);
+}
+
+TEST_F(gbm_cross_domain_test, import_batch_imports_swapchain)
+{
+	const uint32_t width = 64, height = 32, stride = width * 4;
+	const uint32_t num_buffers = 3;
+	struct gbm_import_fd_modifier_data buffers[num_buffers] = {};
+	struct gbm_bo *bos[num_buffers];
+
+	// All buffers are suballocated from one dma-buf, as some clients do.
+	int fd = memfd_create("swapchain", MFD_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(ftruncate(fd, stride * height * num_buffers), 0);
+
+	for (uint32_t i = 0; i < num_buffers; i++) {
+		buffers[i].width = width;
+		buffers[i].height = height;
+		buffers[i].format = GBM_FORMAT_XRGB8888;
+		buffers[i].num_fds = 1;
+		buffers[i].fds[0] = fd;
+		buffers[i].strides[0] = stride;
+		buffers[i].offsets[0] = stride * height * i;
+		buffers[i].modifier = DRM_FORMAT_MOD_LINEAR;
+	}
+
+	ASSERT_EQ(gbm_bo_import_batch(gbm_, buffers, num_buffers, GBM_BO_USE_RENDERING, bos), 0);
+	EXPECT_EQ(fake_.prime_imports, static_cast<int>(num_buffers));
+
+	for (uint32_t i = 0; i < num_buffers; i++) {
+		ASSERT_TRUE(bos[i]);
+		EXPECT_EQ(gbm_bo_get_width(bos[i]), width);
+		EXPECT_EQ(gbm_bo_get_stride(bos[i]), stride);
+		EXPECT_EQ(gbm_bo_get_offset(bos[i], 0), stride * height * i);
+		EXPECT_EQ(gbm_bo_get_handle(bos[i]).u32, gbm_bo_get_handle(bos[0]).u32);
+	}
+
+	// The buffers share a handle, destroying one must not release it under the others.
+	for (uint32_t i = 0; i < num_buffers; i++)
+		gbm_bo_destroy(bos[i]);
+
+	close(fd);
+}
+
+TEST_F(gbm_cross_domain_test, import_batch_is_all_or_nothing)
+{
+	struct gbm_import_fd_modifier_data buffers[2] = {};
+	struct gbm_bo *bos[2];
+
+	int fd = memfd_create("buffer", MFD_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(ftruncate(fd, 16 * 16 * 4), 0);
+
+	for (auto &buffer : buffers) {
+		buffer.width = 16;
+		buffer.height = 16;
+		buffer.format = GBM_FORMAT_XRGB8888;
+		buffer.num_fds = 1;
+		buffer.fds[0] = fd;
+		buffer.strides[0] = 16 * 4;
+		buffer.modifier = DRM_FORMAT_MOD_LINEAR;
+	}
+	// The second buffer is not backed by a dma-buf.
+	buffers[1].fds[0] = -1;
+
+	EXPECT_LT(gbm_bo_import_batch(gbm_, buffers, 2, GBM_BO_USE_RENDERING, bos), 0);
+	EXPECT_FALSE(bos[0]);
+	EXPECT_FALSE(bos[1]);
+
+	close(fd);
+}
+
+class gbm_connector_monitor_test : public testing::Test
+{
+      protected:
+	void SetUp() override
+	{
+		// The fake DRM fd resolves to node 0, like card0.
+		fake_.fd = memfd_create("fake-kms", MFD_CLOEXEC);
+		fake_.connections = { DRM_MODE_CONNECTED, DRM_MODE_DISCONNECTED };
+		fake_kms = &fake_;
+		ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, uevents_), 0);
+	}
+
+	void TearDown() override
+	{
+		close(uevents_[1]);
+		fake_kms = nullptr;
+		close(fake_.fd);
+	}
+
+	void SendUevent(const std::vector<std::string> &keys)
+	{
+		std::string msg = "change@/devices/drm/card0";
+		msg.push_back('\0');
+		for (const auto &key : keys) {
+			msg += key;
+			msg.push_back('\0');
+		}
+		ASSERT_EQ(send(uevents_[1], msg.data(), msg.size(), 0),
+			  static_cast<ssize_t>(msg.size()));
+	}
+
+	FakeKms fake_;
+	int uevents_[2] = { -1, -1 };
+};
+
+TEST_F(gbm_connector_monitor_test, refreshes_only_on_hotplug)
+{
+	struct gbm_connector_monitor *monitor =
+	    gbm_connector_monitor_create_with_uevent_fd(fake_.fd, uevents_[0]);
+	ASSERT_TRUE(monitor);
+	EXPECT_EQ(gbm_connector_monitor_get_fd(monitor), uevents_[0]);
+
+	struct gbm_device_info info;
+	ASSERT_EQ(gbm_connector_monitor_get_info(monitor, &info), 0);
+	EXPECT_EQ(info.connectors, 2u);
+	EXPECT_EQ(info.connected, 1u);
+	const int probes = fake_.connector_queries;
+
+	// Queries are answered from the cache until a hotplug event for this device arrives.
+	fake_.connections[1] = DRM_MODE_CONNECTED;
+	SendUevent({ "ACTION=change", "SUBSYSTEM=drm", "DEVNAME=dri/card1", "HOTPLUG=1" });
+	SendUevent({ "ACTION=change", "SUBSYSTEM=usb", "DEVNAME=bus/usb/001/002" });
+	ASSERT_EQ(gbm_connector_monitor_get_info(monitor, &info), 0);
+	EXPECT_EQ(info.connected, 1u);
+	EXPECT_EQ(fake_.connector_queries, probes);
+
+	SendUevent({ "ACTION=change", "SUBSYSTEM=drm", "DEVNAME=dri/card0", "HOTPLUG=1" });
+	SendUevent({ "ACTION=change", "SUBSYSTEM=drm", "DEVNAME=dri/card0", "HOTPLUG=1" });
+	EXPECT_EQ(gbm_connector_monitor_dispatch(monitor), 1);
+	EXPECT_EQ(gbm_connector_monitor_dispatch(monitor), 0);
+	ASSERT_EQ(gbm_connector_monitor_get_info(monitor, &info), 0);
+	EXPECT_EQ(info.connected, 2u);
+	// Both events were handled by a single probe of the two connectors.
+	EXPECT_EQ(fake_.connector_queries, probes + 2);
+
+	// An explicit refresh re-probes without an event.
+	fake_.connections[0] = DRM_MODE_DISCONNECTED;
+	EXPECT_EQ(gbm_connector_monitor_refresh(monitor), 1);
+	ASSERT_EQ(gbm_connector_monitor_get_info(monitor, &info), 0);
+	EXPECT_EQ(info.connected, 1u);
+
+	gbm_connector_monitor_destroy(monitor);
+}
+
+#ifdef DRV_HBM_HELPER
+extern "C" {
+#include "hbm.h"
+#include "hbm_minigbm.h"
+}
+
+/*
+ * Fake libhbm device for the staging pool tests. Resources are tiled so that every map goes
+ * through staging, and staging bos are counted so tests can tell slab reuse from a new slab.
+ */
+struct hbm_device {
+};
+
+struct hbm_bo {
+	uint64_t size;
+	bool staging;
+	void *ptr;
+};
+
+struct FakeHbm {
+	hbm_device device;
+	int staging_created = 0;
+	int staging_destroyed = 0;
+	bool fail_staging = false;
+};
+
+static FakeHbm *fake_hbm;
+
+int drmGetNodeTypeFromDevId(dev_t devid)
+{
+	return fake_hbm ? DRM_NODE_RENDER : -EINVAL;
+}
+
+void hbm_log_init(enum hbm_log_level level,
+		  void (*callback)(enum hbm_log_level, const char *, void *), void *data)
+{
+}
+
+struct hbm_device *hbm_device_create(dev_t dev_id, bool debug)
+{
+	return fake_hbm ? &fake_hbm->device : nullptr;
+}
+
+void hbm_device_destroy(struct hbm_device *device)
+{
+}
+
+bool hbm_device_has_modifier(struct hbm_device *device, const struct hbm_description *desc,
+			     uint64_t modifier)
+{
+	return false;
+}
+
+int hbm_device_get_modifiers(struct hbm_device *device, const struct hbm_description *desc,
+			     uint32_t count, uint64_t *modifiers)
+{
+	return 0;
+}
+
+uint32_t hbm_device_get_plane_count(struct hbm_device *device, uint32_t format, uint64_t modifier)
+{
+	return 1;
+}
+
+struct hbm_bo *hbm_bo_create_with_constraint(struct hbm_device *device,
+					     const struct hbm_description *desc,
+					     const union hbm_extent *extent,
+					     const struct hbm_constraint *con)
+{
+	auto *bo = new hbm_bo();
+	bo->staging = desc->format == DRM_FORMAT_INVALID;
+	if (bo->staging) {
+		if (fake_hbm->fail_staging) {
+			delete bo;
+			return nullptr;
+		}
+		bo->size = extent->buffer.size;
+		fake_hbm->staging_created++;
+	} else {
+		bo->size = (uint64_t)extent->image.width * extent->image.height * 4;
+	}
+	return bo;
+}
+
+struct hbm_bo *hbm_bo_create_with_layout(struct hbm_device *device,
+					 const struct hbm_description *desc,
+					 const union hbm_extent *extent,
+					 const struct hbm_layout *layout, int dmabuf)
+{
+	return nullptr;
+}
+
+void hbm_bo_destroy(struct hbm_bo *bo)
+{
+	if (bo->staging)
+		fake_hbm->staging_destroyed++;
+	free(bo->ptr);
+	delete bo;
+}
+
+void hbm_bo_layout(struct hbm_bo *bo, struct hbm_layout *out_layout)
+{
+	*out_layout = {};
+	out_layout->size = bo->size;
+	out_layout->modifier = I915_FORMAT_MOD_Y_TILED;
+	out_layout->plane_count = 1;
+}
+
+uint32_t hbm_bo_memory_types(struct hbm_bo *bo, uint32_t count, uint32_t *mts)
+{
+	const uint32_t types[] = { HBM_MEMORY_TYPE_LOCAL, HBM_MEMORY_TYPE_MAPPABLE |
+							      HBM_MEMORY_TYPE_COHERENT |
+							      HBM_MEMORY_TYPE_CACHED };
+	for (uint32_t i = 0; i < count && i < 2; i++)
+		mts[i] = types[i];
+	return 2;
+}
+
+bool hbm_bo_bind_memory(struct hbm_bo *bo, uint32_t mt, int dmabuf)
+{
+	return true;
+}
+
+int hbm_bo_export_dma_buf(struct hbm_bo *bo, const char *name)
+{
+	return -1;
+}
+
+void *hbm_bo_map(struct hbm_bo *bo)
+{
+	if (!bo->ptr)
+		bo->ptr = calloc(1, bo->size);
+	return bo->ptr;
+}
+
+void hbm_bo_unmap(struct hbm_bo *bo)
+{
+}
+
+void hbm_bo_flush(struct hbm_bo *bo)
+{
+}
+
+void hbm_bo_invalidate(struct hbm_bo *bo)
+{
+}
+
+bool hbm_bo_copy_buffer(struct hbm_bo *bo, struct hbm_bo *src, const struct hbm_copy_buffer *copy,
+			int in_fence, int *out_fence)
+{
+	*out_fence = -1;
+	return true;
+}
+
+bool hbm_bo_copy_buffer_image(struct hbm_bo *bo, struct hbm_bo *src,
+			      const struct hbm_copy_buffer_image *copy, int in_fence,
+			      int *out_fence)
+{
+	*out_fence = -1;
+	return true;
+}
+
+class gbm_hbm_test : public testing::Test
+{
+      protected:
+	void SetUp() override
+	{
+		fake_hbm = &fake_;
+		fd_ = open("/dev/null", O_RDWR | O_CLOEXEC);
+		ASSERT_GE(fd_, 0);
+		hbm_ = hbm_create(fd_);
+		ASSERT_TRUE(hbm_);
+		// hbm_create probes the staging memory type with a throwaway bo.
+		base_ = fake_.staging_created;
+	}
+
+	void TearDown() override
+	{
+		if (hbm_)
+			hbm_destroy(hbm_);
+		EXPECT_EQ(fake_.staging_created, fake_.staging_destroyed);
+		fake_hbm = nullptr;
+		close(fd_);
+	}
+
+	struct hbm_resource *Allocate(uint32_t width, uint32_t height)
+	{
+		struct bo_metadata meta = {};
+		const uint64_t mod = I915_FORMAT_MOD_Y_TILED;
+		return hbm_allocate(hbm_, width, height, DRM_FORMAT_ARGB8888,
+				    BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN, &mod, 1, &meta);
+	}
+
+	FakeHbm fake_;
+	int fd_ = -1;
+	int base_ = 0;
+	struct hbm *hbm_ = nullptr;
+};
+
+TEST_F(gbm_hbm_test, staging_slabs_are_reused)
+{
+	// 64x64 ARGB needs 16 KiB of staging, served from a 64 KiB slot of a 2 MiB slab.
+	struct hbm_resource *res = Allocate(64, 64);
+	ASSERT_TRUE(res);
+
+	struct vma first = {}, second = {};
+	void *ptr = hbm_map(hbm_, res, &first, BO_MAP_READ);
+	ASSERT_TRUE(ptr);
+	EXPECT_EQ(fake_.staging_created, base_ + 1);
+
+	// A concurrent map gets another slot of the same slab.
+	void *other = hbm_map(hbm_, res, &second, BO_MAP_READ);
+	ASSERT_TRUE(other);
+	EXPECT_NE(other, ptr);
+	EXPECT_EQ(fake_.staging_created, base_ + 1);
+	hbm_unmap(hbm_, res, &second);
+
+	// Released slots are handed out again without creating or destroying staging memory.
+	hbm_unmap(hbm_, res, &first);
+	EXPECT_EQ(hbm_map(hbm_, res, &first, BO_MAP_READ), ptr);
+	hbm_unmap(hbm_, res, &first);
+	EXPECT_EQ(fake_.staging_created, base_ + 1);
+	EXPECT_EQ(fake_.staging_destroyed, base_);
+
+	hbm_free(hbm_, res);
+}
+
+TEST_F(gbm_hbm_test, full_slab_falls_back_to_new_slab)
+{
+	struct hbm_resource *res = Allocate(64, 64);
+	ASSERT_TRUE(res);
+
+	// A 2 MiB slab has 32 slots of 64 KiB; the 33rd map needs a second slab.
+	std::vector<struct vma> vmas(33);
+	for (size_t i = 0; i < 32; i++)
+		ASSERT_TRUE(hbm_map(hbm_, res, &vmas[i], BO_MAP_READ));
+	EXPECT_EQ(fake_.staging_created, base_ + 1);
+	ASSERT_TRUE(hbm_map(hbm_, res, &vmas[32], BO_MAP_READ));
+	EXPECT_EQ(fake_.staging_created, base_ + 2);
+
+	// When no slab has room and none can be created, the map fails instead of corrupting a
+	// slot in use.
+	struct vma extra = {};
+	for (size_t i = 33; i < 64; i++) {
+		vmas.emplace_back();
+		ASSERT_TRUE(hbm_map(hbm_, res, &vmas.back(), BO_MAP_READ));
+	}
+	fake_.fail_staging = true;
+	EXPECT_FALSE(hbm_map(hbm_, res, &extra, BO_MAP_READ));
+	fake_.fail_staging = false;
+
+	for (auto &vma : vmas)
+		hbm_unmap(hbm_, res, &vma);
+	EXPECT_EQ(fake_.staging_created, base_ + 2);
+
+	hbm_free(hbm_, res);
+}
+
+TEST_F(gbm_hbm_test, idle_slabs_are_released_over_budget)
+{
+	// 1024x2048 ARGB needs 8 MiB of staging, which gets a dedicated slab.
+	struct hbm_resource *res = Allocate(1024, 2048);
+	ASSERT_TRUE(res);
+
+	// Nine busy slabs exceed the 64 MiB budget, but slabs in use are never released.
+	std::vector<struct vma> vmas(9);
+	for (auto &vma : vmas)
+		ASSERT_TRUE(hbm_map(hbm_, res, &vma, BO_MAP_READ));
+	EXPECT_EQ(fake_.staging_created, base_ + 9);
+	EXPECT_EQ(fake_.staging_destroyed, base_);
+
+	// Once idle, the least recently used slab is released to get back under budget and the
+	// others are kept for reuse.
+	for (auto &vma : vmas)
+		hbm_unmap(hbm_, res, &vma);
+	EXPECT_EQ(fake_.staging_destroyed, base_ + 1);
+
+	struct vma vma = {};
+	ASSERT_TRUE(hbm_map(hbm_, res, &vma, BO_MAP_READ));
+	EXPECT_EQ(fake_.staging_created, base_ + 9);
+	hbm_unmap(hbm_, res, &vma);
+
+	hbm_free(hbm_, res);
+
+	// Destroying the device releases the rest of the pool.
+	hbm_destroy(hbm_);
+	hbm_ = nullptr;
+	EXPECT_EQ(fake_.staging_destroyed, base_ + 9);
+}
+#endif
@@ -24,9 +24,12 @@
  *  - implicit modifier is passed through to hbm, which can be rejected
  *    however
  *  - implicit fencing is simulated via dma-buf polling
- *    - we could potentially use DMA_BUF_IOCTL_{EXPORT,IMPORT}_SYNC_FILE to
- *      convert between implicit and explicit fencing
+ *    - staging copies use DMA_BUF_IOCTL_{EXPORT,IMPORT}_SYNC_FILE, when
+ *      available, to convert between implicit and explicit fencing
  *  - a staging bo is used when the bo is tiled
+ *    - staging memory is suballocated from a pool of persistently bound and
+ *      mapped slabs, so that cpu access does not allocate and bind memory on
+ *      every map
  */
 
 #include "hbm.h"
@@ -35,12 +38,51 @@
 #include <assert.h>
 #include <drm_fourcc.h>
 #include <errno.h>
+#include <linux/dma-buf.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv_helpers.h"
+#include "util.h"
+
+/* Staging slabs smaller than STAGING_SLAB_SIZE are split into power-of-two
+ * slots of at least STAGING_MIN_SLOT_SIZE.  Larger requests get a slab of
+ * their own, rounded up to STAGING_SLAB_SIZE so that it can be reused by
+ * similarly sized resources.  Idle slabs are kept around until the pool
+ * exceeds STAGING_BUDGET, at which point the least recently used ones are
+ * destroyed.
+ */
+#define STAGING_MIN_SLOT_SIZE (64ull * 1024)
+#define STAGING_SLAB_SIZE (2ull * 1024 * 1024)
+#define STAGING_MAX_SLOTS (STAGING_SLAB_SIZE / STAGING_MIN_SLOT_SIZE)
+#define STAGING_BUDGET (64ull * 1024 * 1024)
+
+struct staging_slab;
+
+struct staging_range {
+	struct staging_slab *slab;
+	uint64_t offset;
+	void *ptr;
+};
+
+struct staging_slab {
+	struct hbm_bo *bo;
+	void *ptr;
+	uint64_t size;
+
+	uint64_t slot_size;
+	uint32_t slot_count;
+	uint32_t used_mask;
+	/* for LRU reclaim of idle slabs */
+	uint64_t last_used;
+
+	struct staging_slab *next;
+	struct staging_range ranges[STAGING_MAX_SLOTS];
+};
 
 struct hbm {
 	struct hbm_device *device;
@@ -48,11 +90,17 @@ struct hbm {
 	int driver_fd;
 
 	uint32_t staging_mt;
+
+	pthread_mutex_t staging_lock;
+	struct staging_slab *staging_slabs;
+	uint64_t staging_bytes;
+	uint64_t staging_tick;
 };
 
 struct hbm_resource {
 	struct hbm_bo *bo;
 	uint32_t format;
+	uint32_t mt;
 
 	bool use_sw;
 	/* owned */
@@ -133,6 +181,7 @@ struct hbm *hbm_create(int drv_fd)
 		return NULL;
 	}
 
+	pthread_mutex_init(&hbm->staging_lock, NULL);
 	hbm->device = dev;
 	/* no ownership transfer */
 	hbm->driver_fd = drv_fd;
@@ -146,8 +195,23 @@ struct hbm *hbm_create(int drv_fd)
 	return hbm;
 }
 
+static void destroy_staging_slabs(struct staging_slab *slab)
+{
+	while (slab) {
+		struct staging_slab *next = slab->next;
+		hbm_bo_unmap(slab->bo);
+		hbm_bo_destroy(slab->bo);
+		free(slab);
+		slab = next;
+	}
+}
+
 void hbm_destroy(struct hbm *hbm)
 {
+	/* all mappings must be gone by now */
+	destroy_staging_slabs(hbm->staging_slabs);
+	pthread_mutex_destroy(&hbm->staging_lock);
+
 	hbm_device_destroy(hbm->device);
 	free(hbm);
 }
@@ -399,6 +463,7 @@ static struct hbm_resource *create_resource(struct hbm *hbm, struct hbm_bo *bo,
 
 	res->bo = bo;
 	res->format = desc->format;
+	res->mt = mt;
 
 	res->use_sw = use_sw(use_flags);
 	res->implicit_fence_dmabuf = -1;
@@ -643,28 +708,169 @@ static uint32_t pick_staging_memory_type(struct hbm *hbm)
 	return best_mt;
 }
 
-void *hbm_map(struct hbm *hbm, struct hbm_resource *res, struct vma *vma, uint32_t map_flags)
+static uint64_t staging_slot_size(uint64_t size)
 {
-	if (!res->staging_size)
-		return hbm_bo_map(res->bo);
+	if (size > STAGING_SLAB_SIZE / 2)
+		return ALIGN(size, STAGING_SLAB_SIZE);
+
+	uint64_t slot_size = STAGING_MIN_SLOT_SIZE;
+	while (slot_size < size)
+		slot_size <<= 1;
+
+	return slot_size;
+}
+
+static struct staging_slab *create_staging_slab(struct hbm *hbm, uint64_t slot_size)
+{
+	const uint64_t size = MAX(slot_size, STAGING_SLAB_SIZE);
 
-	struct hbm_bo *staging = create_staging(hbm, res->staging_size);
-	if (!staging)
+	struct staging_slab *slab = calloc(1, sizeof(*slab));
+	if (!slab)
 		return NULL;
-	if (!hbm_bo_bind_memory(staging, hbm->staging_mt, -1)) {
-		hbm_bo_destroy(staging);
+
+	slab->bo = create_staging(hbm, size);
+	if (!slab->bo) {
+		free(slab);
 		return NULL;
 	}
 
-	void *ptr = hbm_bo_map(staging);
-	if (!ptr) {
-		hbm_bo_destroy(staging);
+	if (!hbm_bo_bind_memory(slab->bo, hbm->staging_mt, -1)) {
+		hbm_bo_destroy(slab->bo);
+		free(slab);
 		return NULL;
 	}
 
-	vma->priv = staging;
+	slab->ptr = hbm_bo_map(slab->bo);
+	if (!slab->ptr) {
+		hbm_bo_destroy(slab->bo);
+		free(slab);
+		return NULL;
+	}
 
-	return ptr;
+	slab->size = size;
+	slab->slot_size = slot_size;
+	slab->slot_count = size / slot_size;
+	for (uint32_t i = 0; i < slab->slot_count; i++) {
+		slab->ranges[i] = (struct staging_range){
+			.slab = slab,
+			.offset = slot_size * i,
+			.ptr = (uint8_t *)slab->ptr + slot_size * i,
+		};
+	}
+
+	return slab;
+}
+
+static struct staging_range *take_staging_slot(struct staging_slab *slab)
+{
+	const uint32_t all_mask =
+	    slab->slot_count < 32 ? (1u << slab->slot_count) - 1 : UINT32_MAX;
+	const uint32_t free_mask = all_mask & ~slab->used_mask;
+	if (!free_mask)
+		return NULL;
+
+	const uint32_t slot = __builtin_ctz(free_mask);
+	slab->used_mask |= 1u << slot;
+
+	return &slab->ranges[slot];
+}
+
+/* Unlinks idle slabs, least recently used first, until the pool plus
+ * incoming_size fits in the budget.  The unlinked slabs are returned so that
+ * the caller can destroy them without holding staging_lock.
+ */
+static struct staging_slab *reclaim_staging_slabs(struct hbm *hbm, uint64_t incoming_size)
+{
+	struct staging_slab *reclaimed = NULL;
+
+	while (hbm->staging_bytes + incoming_size > STAGING_BUDGET) {
+		struct staging_slab **victim = NULL;
+		for (struct staging_slab **slab = &hbm->staging_slabs; *slab;
+		     slab = &(*slab)->next) {
+			if ((*slab)->used_mask)
+				continue;
+			if (!victim || (*slab)->last_used < (*victim)->last_used)
+				victim = slab;
+		}
+		if (!victim)
+			break;
+
+		struct staging_slab *slab = *victim;
+		*victim = slab->next;
+		hbm->staging_bytes -= slab->size;
+
+		slab->next = reclaimed;
+		reclaimed = slab;
+	}
+
+	return reclaimed;
+}
+
+static struct staging_range *alloc_staging(struct hbm *hbm, uint64_t size)
+{
+	const uint64_t slot_size = staging_slot_size(size);
+	struct staging_range *range = NULL;
+
+	pthread_mutex_lock(&hbm->staging_lock);
+	for (struct staging_slab *slab = hbm->staging_slabs; slab; slab = slab->next) {
+		if (slab->slot_size != slot_size)
+			continue;
+
+		range = take_staging_slot(slab);
+		if (range)
+			break;
+	}
+	struct staging_slab *reclaimed =
+	    range ? NULL : reclaim_staging_slabs(hbm, MAX(slot_size, STAGING_SLAB_SIZE));
+	pthread_mutex_unlock(&hbm->staging_lock);
+
+	destroy_staging_slabs(reclaimed);
+	if (range)
+		return range;
+
+	/* allocate and bind outside of the lock */
+	struct staging_slab *slab = create_staging_slab(hbm, slot_size);
+	if (!slab)
+		return NULL;
+
+	pthread_mutex_lock(&hbm->staging_lock);
+	slab->next = hbm->staging_slabs;
+	hbm->staging_slabs = slab;
+	hbm->staging_bytes += slab->size;
+	range = take_staging_slot(slab);
+	pthread_mutex_unlock(&hbm->staging_lock);
+
+	return range;
+}
+
+static void free_staging(struct hbm *hbm, struct staging_range *range)
+{
+	struct staging_slab *slab = range->slab;
+	struct staging_slab *reclaimed = NULL;
+
+	pthread_mutex_lock(&hbm->staging_lock);
+	slab->used_mask &= ~(1u << (range - slab->ranges));
+	if (!slab->used_mask) {
+		slab->last_used = ++hbm->staging_tick;
+		reclaimed = reclaim_staging_slabs(hbm, 0);
+	}
+	pthread_mutex_unlock(&hbm->staging_lock);
+
+	destroy_staging_slabs(reclaimed);
+}
+
+void *hbm_map(struct hbm *hbm, struct hbm_resource *res, struct vma *vma, uint32_t map_flags)
+{
+	if (!res->staging_size)
+		return hbm_bo_map(res->bo);
+
+	struct staging_range *range = alloc_staging(hbm, res->staging_size);
+	if (!range)
+		return NULL;
+
+	vma->priv = range;
+
+	return range->ptr;
 }
 
 void hbm_unmap(struct hbm *hbm, struct hbm_resource *res, struct vma *vma)
@@ -674,42 +880,83 @@ void hbm_unmap(struct hbm *hbm, struct hbm_resource *res, struct vma *vma)
 		return;
 	}
 
-	struct hbm_bo *staging = vma->priv;
-	hbm_bo_unmap(staging);
-	hbm_bo_destroy(staging);
+	free_staging(hbm, vma->priv);
 }
 
-static bool wait_resource(struct hbm_resource *res, uint32_t map_flags)
+static bool poll_fd(int fd, short events)
 {
-	const int timeout = -1;
-
-	if (res->implicit_fence_dmabuf < 0)
-		return true;
-
 	struct pollfd pollfd = {
-		.fd = res->implicit_fence_dmabuf,
-		.events = (map_flags & BO_MAP_WRITE) ? POLLOUT : POLLIN,
+		.fd = fd,
+		.events = events,
 	};
 
+	/* wait initially for 1000 ms, and then indefinitely */
+	int timeout = 1000;
 	while (true) {
 		const int ret = poll(&pollfd, 1, timeout);
 		if (ret > 0)
 			return pollfd.revents & pollfd.events;
-		else if (ret == 0 || !(errno == EINTR || errno == EAGAIN))
+
+		if (ret == 0) {
+			drv_loge("hbm: timed out waiting for fd %d\n", fd);
+			timeout = -1;
+		} else if (!(errno == EINTR || errno == EAGAIN)) {
 			return false;
+		}
 	}
 }
 
+static bool wait_resource(struct hbm_resource *res, uint32_t map_flags)
+{
+	if (res->implicit_fence_dmabuf < 0)
+		return true;
+
+	return poll_fd(res->implicit_fence_dmabuf, (map_flags & BO_MAP_WRITE) ? POLLOUT : POLLIN);
+}
+
+/* Snapshots the implicit fences of the resource as a sync_file, so that a
+ * staging copy can wait for them on the gpu instead of on the cpu.  Returns
+ * false if the kernel does not support that.
+ */
+static bool export_implicit_fence(struct hbm_resource *res, bool write, int *out_fence)
+{
+	*out_fence = -1;
+	if (res->implicit_fence_dmabuf < 0)
+		return true;
+
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	struct dma_buf_export_sync_file args = {
+		.flags = write ? DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ,
+		.fd = -1,
+	};
+	if (drmIoctl(res->implicit_fence_dmabuf, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &args))
+		return false;
+
+	*out_fence = args.fd;
+	return true;
+#else
+	return false;
+#endif
+}
+
 bool hbm_sync(struct hbm *hbm, struct hbm_resource *res, const struct mapping *mapping,
 	      uint32_t plane, bool flush)
 {
 	const struct rectangle *rect = &mapping->rect;
 
-	if (!wait_resource(res, mapping->vma->map_flags))
-		return false;
+	if (!rect->width || !rect->height)
+		return true;
 
 	if (!res->staging_size) {
-		/* TODO respect rect */
+		if (!wait_resource(res, mapping->vma->map_flags))
+			return false;
+
+		/* hbm can only flush/invalidate the whole bo.  Coherent memory
+		 * needs neither, regardless of the rect.
+		 */
+		if (res->mt & HBM_MEMORY_TYPE_COHERENT)
+			return true;
+
 		if (flush)
 			hbm_bo_flush(res->bo);
 		else
@@ -720,29 +967,36 @@ bool hbm_sync(struct hbm *hbm, struct hbm_resource *res, const struct mapping *m
 	/* create_staging requires HBM_MEMORY_TYPE_COHERENT and there is no
 	 * need to flush/invalidate
 	 */
+	struct staging_range *range = mapping->vma->priv;
 	struct hbm_bo *src;
 	struct hbm_bo *dst;
 	if (flush) {
-		src = mapping->vma->priv;
+		src = range->slab->bo;
 		dst = res->bo;
 	} else {
 		src = res->bo;
-		dst = mapping->vma->priv;
+		dst = range->slab->bo;
 	}
 
+	/* let the copy wait for the implicit fences rather than the cpu */
+	int in_fence;
+	if (!export_implicit_fence(res, flush, &in_fence) &&
+	    !wait_resource(res, flush ? BO_MAP_WRITE : BO_MAP_READ))
+		return false;
+
 	bool ret;
 	if (res->format == DRM_FORMAT_INVALID) {
 		const struct hbm_copy_buffer copy = {
-			.src_offset = rect->x,
-			.dst_offset = rect->x,
+			.src_offset = flush ? range->offset + rect->x : rect->x,
+			.dst_offset = flush ? rect->x : range->offset + rect->x,
 			.size = rect->width,
 		};
-		ret = hbm_bo_copy_buffer(dst, src, &copy, -1, NULL);
+		ret = hbm_bo_copy_buffer(dst, src, &copy, in_fence, NULL);
 	} else {
 		const uint32_t bpp = drv_bytes_per_pixel_from_format(res->format, plane);
 		const uint64_t stride = res->staging_strides[plane];
-		const uint64_t offset =
-		    res->staging_offsets[plane] + stride * rect->y + bpp * rect->x;
+		const uint64_t offset = range->offset + res->staging_offsets[plane] +
+					stride * rect->y + bpp * rect->x;
 
 		const struct hbm_copy_buffer_image copy = {
 			.offset = offset,
@@ -753,9 +1007,16 @@ bool hbm_sync(struct hbm *hbm, struct hbm_resource *res, const struct mapping *m
 			.width = rect->width,
 			.height = rect->height,
 		};
-		ret = hbm_bo_copy_buffer_image(dst, src, &copy, -1, NULL);
+		ret = hbm_bo_copy_buffer_image(dst, src, &copy, in_fence, NULL);
 	}
 
+	/* hbm does not take ownership of in_fence */
+	if (in_fence >= 0)
+		close(in_fence);
+
+	/* without an out fence, the copy completes before hbm returns, so the
+	 * staging range can be reused right away
+	 */
 	return ret;
 }
 
@@ -893,8 +1154,8 @@ int dri_bo_destroy(struct dri_driver *dri, struct bo *bo)
 	return 0;
 }
 
-void *dri_bo_map(struct dri_driver *dri, struct bo *bo, struct vma *vma, size_t plane,
-		 uint32_t map_flags)
+void *dri_bo_map(struct dri_driver *dri, struct bo *bo, struct vma *vma,
+		 const struct rectangle *rect, size_t plane, uint32_t map_flags)
 {
 	struct hbm *hbm = (struct hbm *)dri;
 
@@ -14,10 +14,13 @@
 #include <linux/dma-heap.h>
 #endif
 #include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <mediatek_drm.h>
@@ -73,12 +76,18 @@
 
 struct mediatek_private_drv_data {
 	int dma_heap_fd;
+	/* bound on implicit fence waits in mediatek_bo_invalidate, -1 for none */
+	int fence_timeout_ms;
+};
+
+struct mediatek_private_bo_data {
+	/* exported on first use for implicit fence polling, -1 until then */
+	atomic_int prime_fd;
 };
 
 struct mediatek_private_map_data {
 	void *cached_addr;
 	void *gem_addr;
-	int prime_fd;
 };
 
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
@@ -137,6 +146,10 @@ static int mediatek_init(struct driver *drv)
 	}
 
 	priv->dma_heap_fd = -1;
+	priv->fence_timeout_ms = -1;
+	const char *timeout_ms = drv_get_os_option("MINIGBM_MEDIATEK_FENCE_TIMEOUT_MS");
+	if (timeout_ms)
+		priv->fence_timeout_ms = atoi(timeout_ms);
 	drv->priv = priv;
 
 	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
@@ -228,6 +241,18 @@ static void mediatek_close(struct driver *drv)
 	drv->priv = NULL;
 }
 
+static int mediatek_bo_init_priv(struct bo *bo)
+{
+	struct mediatek_private_bo_data *priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return -ENOMEM;
+
+	atomic_init(&priv->prime_fd, -1);
+	bo->priv = priv;
+
+	return 0;
+}
+
 static int mediatek_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 					     uint32_t format, const uint64_t *modifiers,
 					     uint32_t count)
@@ -407,7 +432,10 @@ static int mediatek_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 		drv_loge("Protected allocation not supported\n");
 		return -1;
 #endif
-		return 0;
+		ret = mediatek_bo_init_priv(bo);
+		if (ret)
+			drv_gem_bo_destroy(bo);
+		return ret;
 	}
 
 	/*
@@ -436,7 +464,11 @@ static int mediatek_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 
 	bo->handle.u32 = gem_create.handle;
 
-	return 0;
+	ret = mediatek_bo_init_priv(bo);
+	if (ret)
+		drv_gem_bo_destroy(bo);
+
+	return ret;
 }
 
 static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
@@ -447,9 +479,59 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
+static int mediatek_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret = drv_prime_bo_import(bo, data);
+	if (ret)
+		return ret;
+
+	ret = mediatek_bo_init_priv(bo);
+	if (ret)
+		drv_gem_bo_destroy(bo);
+
+	return ret;
+}
+
+static int mediatek_bo_release(struct bo *bo)
+{
+	struct mediatek_private_bo_data *priv = bo->priv;
+
+	if (priv) {
+		const int prime_fd = atomic_load(&priv->prime_fd);
+		if (prime_fd >= 0)
+			close(prime_fd);
+		free(priv);
+		bo->priv = NULL;
+	}
+
+	return 0;
+}
+
+/* Returns the cached prime fd of the bo, exporting it on first use. */
+static int mediatek_bo_get_prime_fd(struct bo *bo)
+{
+	struct mediatek_private_bo_data *priv = bo->priv;
+	int prime_fd = atomic_load(&priv->prime_fd);
+	if (prime_fd >= 0)
+		return prime_fd;
+
+	prime_fd = drv_bo_get_plane_fd(bo, 0);
+	if (prime_fd < 0)
+		return prime_fd;
+
+	int expected = -1;
+	if (!atomic_compare_exchange_strong(&priv->prime_fd, &expected, prime_fd)) {
+		/* lost the race to another thread */
+		close(prime_fd);
+		prime_fd = expected;
+	}
+
+	return prime_fd;
+}
+
 static void *mediatek_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 {
-	int ret, prime_fd;
+	int ret;
 	struct drm_mtk_gem_map_off gem_map = { 0 };
 	struct mediatek_private_map_data *priv;
 	void *addr = NULL;
@@ -462,16 +544,10 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 		return MAP_FAILED;
 	}
 
-	prime_fd = drv_bo_get_plane_fd(bo, 0);
-	if (prime_fd < 0) {
-		drv_loge("Failed to get a prime fd\n");
-		return MAP_FAILED;
-	}
-
 	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 		    gem_map.offset);
 	if (addr == MAP_FAILED)
-		goto out_close_prime_fd;
+		return MAP_FAILED;
 
 	vma->length = bo->meta.total_size;
 
@@ -488,7 +564,6 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 		addr = priv->cached_addr;
 	}
 
-	priv->prime_fd = prime_fd;
 	vma->priv = priv;
 
 	return addr;
@@ -497,8 +572,6 @@ out_free_priv:
 	free(priv);
 out_unmap_addr:
 	munmap(addr, bo->meta.total_size);
-out_close_prime_fd:
-	close(prime_fd);
 	return MAP_FAILED;
 }
 
@@ -512,7 +585,6 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 			free(priv->cached_addr);
 		}
 
-		close(priv->prime_fd);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -520,24 +592,59 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 	return munmap(vma->addr, vma->length);
 }
 
-static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
+static int64_t mediatek_now_us(void)
 {
-	struct mediatek_private_map_data *priv = mapping->vma->priv;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	if (priv) {
-		struct pollfd fds = {
-			.fd = priv->prime_fd,
-		};
+/* Waits for the implicit fences of the bo that conflict with map_flags. */
+static void mediatek_bo_wait_idle(struct bo *bo, uint32_t map_flags)
+{
+	struct mediatek_private_drv_data *drv_priv = bo->drv->priv;
+
+	const int prime_fd = mediatek_bo_get_prime_fd(bo);
+	if (prime_fd < 0) {
+		drv_loge("Failed to get a prime fd\n");
+		return;
+	}
+
+	struct pollfd fds = {
+		.fd = prime_fd,
+	};
 
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			fds.events |= POLLOUT;
+	if (map_flags & BO_MAP_WRITE)
+		fds.events |= POLLOUT;
 
-		if (mapping->vma->map_flags & BO_MAP_READ)
-			fds.events |= POLLIN;
+	if (map_flags & BO_MAP_READ)
+		fds.events |= POLLIN;
 
-		poll(&fds, 1, -1);
-		if (fds.revents != fds.events)
-			drv_loge("poll prime_fd failed\n");
+	/* the reservation is usually idle by the time the cpu maps the bo */
+	if (poll(&fds, 1, 0) == 1 && fds.revents == fds.events)
+		return;
+
+	const int64_t start = mediatek_now_us();
+	int ret;
+	do {
+		ret = poll(&fds, 1, drv_priv->fence_timeout_ms);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+	const int64_t elapsed = mediatek_now_us() - start;
+
+	if (ret == 0)
+		drv_loge("Timed out after %" PRId64 " us waiting for prime_fd\n", elapsed);
+	else if (ret < 0 || fds.revents != fds.events)
+		drv_loge("poll prime_fd failed\n");
+	else
+		drv_logd("Waited %" PRId64 " us for prime_fd\n", elapsed);
+}
+
+static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	struct mediatek_private_map_data *priv = mapping->vma->priv;
+
+	if (priv) {
+		mediatek_bo_wait_idle(bo, mapping->vma->map_flags);
 
 		if (priv->cached_addr)
 			memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
@@ -625,8 +732,9 @@ const struct backend backend_mediatek = {
 	.close = mediatek_close,
 	.bo_create = mediatek_bo_create,
 	.bo_create_with_modifiers = mediatek_bo_create_with_modifiers,
+	.bo_release = mediatek_bo_release,
 	.bo_destroy = drv_gem_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = mediatek_bo_import,
 	.bo_map = mediatek_bo_map,
 	.bo_unmap = mediatek_bo_unmap,
 	.bo_invalidate = mediatek_bo_invalidate,
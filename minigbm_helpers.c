@@ -8,19 +8,71 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <pthread.h>
 #include <radeon_drm.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "drv_helpers.h"
 #include "gbm.h"
 #include "minigbm_helpers.h"
 #include "util.h"
 
+#define DEVICE_CACHE_MAGIC 0x44444743 /* "CGDD" */
+#define DEVICE_CACHE_VERSION 1
+
+#define MAX_PROBE_NODES 64
+
+/*
+ * On-disk record of the device picked by gbm_get_default_device_fd. It is reused when the node
+ * still has the same device number and the driver reports the same name and version, so a
+ * launch costs a stat, an open and a drmGetVersion instead of probing every render node.
+ */
+struct device_cache_entry {
+	uint32_t magic;
+	uint32_t version;
+	char path[64];
+	uint64_t rdev;
+	char driver[32];
+	int driver_major;
+	int driver_minor;
+	int driver_patchlevel;
+	int64_t probe_us;
+};
+
+#define UEVENT_BUFFER_SIZE 4096
+
+/*
+ * Cached result of detect_device_info(GBM_DETECT_FLAG_CONNECTED), refreshed when a DRM hotplug
+ * uevent for the device arrives on uevent_fd.
+ */
+struct gbm_connector_monitor {
+	int fd;
+	int uevent_fd;
+	int dri_node_num;
+	pthread_mutex_t lock;
+	struct gbm_device_info info;
+};
+
+struct probe_node {
+	char path[64];
+	int fd;
+	int ret;
+	struct gbm_device_info info;
+	pthread_t thread;
+	bool threaded;
+};
+
 /* These are set in stone. from drm_pciids.h */
 static unsigned int radeon_igp_ids[] = {
 	0x1304, 0x1305, 0x1306, 0x1307, 0x1309, 0x130A, 0x130B, 0x130C, 0x130D, 0x130E, 0x130F,
@@ -213,74 +265,247 @@ done:
 	return 0;
 }
 
-static int gbm_get_default_device_fd(void)
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int device_cache_path(char *path, size_t len)
+{
+	const char *dir = drv_get_os_option("MINIGBM_DEVICE_CACHE_DIR");
+
+	if (!dir)
+		dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir)
+		return -ENOENT;
+
+	snprintf(path, len, "%s/minigbm_default_device.bin", dir);
+	return 0;
+}
+
+static bool device_cache_version_matches(int fd, const struct device_cache_entry *entry)
+{
+	bool match;
+	drmVersionPtr version = drmGetVersion(fd);
+
+	if (!version)
+		return false;
+
+	match = version->version_major == entry->driver_major &&
+		version->version_minor == entry->driver_minor &&
+		version->version_patchlevel == entry->driver_patchlevel &&
+		(size_t)version->name_len == strnlen(entry->driver, sizeof(entry->driver)) &&
+		!strncmp(version->name, entry->driver, version->name_len);
+
+	drmFreeVersion(version);
+	return match;
+}
+
+static int device_cache_open(const char *cache_path, struct device_cache_entry *entry)
+{
+	int fd;
+	ssize_t size;
+	struct stat sb;
+
+	fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	size = read(fd, entry, sizeof(*entry));
+	close(fd);
+
+	if (size != sizeof(*entry) || entry->magic != DEVICE_CACHE_MAGIC ||
+	    entry->version != DEVICE_CACHE_VERSION)
+		return -1;
+
+	entry->path[sizeof(entry->path) - 1] = '\0';
+	if (stat(entry->path, &sb) || !S_ISCHR(sb.st_mode) || sb.st_rdev != entry->rdev)
+		return -1;
+
+	fd = open(entry->path, O_RDWR | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	if (!device_cache_version_matches(fd, entry)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void device_cache_store(const char *cache_path, int fd, const char *path, int64_t probe_us)
+{
+	int cache_fd;
+	bool ok;
+	char tmp_path[PATH_MAX + 16];
+	struct stat sb;
+	struct device_cache_entry entry;
+	drmVersionPtr version;
+
+	if (fstat(fd, &sb))
+		return;
+
+	version = drmGetVersion(fd);
+	if (!version)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.magic = DEVICE_CACHE_MAGIC;
+	entry.version = DEVICE_CACHE_VERSION;
+	snprintf(entry.path, sizeof(entry.path), "%s", path);
+	entry.rdev = sb.st_rdev;
+	snprintf(entry.driver, sizeof(entry.driver), "%.*s", version->name_len, version->name);
+	entry.driver_major = version->version_major;
+	entry.driver_minor = version->version_minor;
+	entry.driver_patchlevel = version->version_patchlevel;
+	entry.probe_us = probe_us;
+	drmFreeVersion(version);
+
+	// Write to a private file and rename so that concurrent readers never see a partial entry.
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache_path, getpid());
+	cache_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cache_fd < 0)
+		return;
+
+	ok = write(cache_fd, &entry, sizeof(entry)) == sizeof(entry);
+	close(cache_fd);
+
+	if (!ok || rename(tmp_path, cache_path)) {
+		drv_logi("Failed to store default device cache %s\n", cache_path);
+		unlink(tmp_path);
+	}
+}
+
+static void *probe_node(void *arg)
+{
+	struct probe_node *node = arg;
+
+	node->fd = open(node->path, O_RDWR | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+	if (node->fd < 0) {
+		node->ret = -errno;
+		return NULL;
+	}
+
+	node->ret = detect_device_info(0, node->fd, &node->info);
+	return NULL;
+}
+
+/*
+ * Probes all render nodes, each on its own thread since detect_device_info may block in the
+ * kernel for a while. Prefers the first integrated display device, then the first discrete one.
+ */
+static int gbm_probe_default_device_fd(char *path, size_t len)
 {
 	DIR *dir;
-	int ret, fd, dfd = -1;
-	char *rendernode_name;
 	struct dirent *dir_ent;
-	struct gbm_device_info info;
+	struct probe_node *nodes;
+	size_t num_nodes = 0, i;
+	int chosen = -1, discrete = -1, fd = -1;
 
 	dir = opendir("/dev/dri");
 	if (!dir)
 		return -errno;
 
-	fd = -1;
-	while ((dir_ent = readdir(dir))) {
+	nodes = calloc(MAX_PROBE_NODES, sizeof(*nodes));
+	if (!nodes) {
+		closedir(dir);
+		return -ENOMEM;
+	}
+
+	while ((dir_ent = readdir(dir)) && num_nodes < MAX_PROBE_NODES) {
+		struct probe_node *node = &nodes[num_nodes];
+
 		if (dir_ent->d_type != DT_CHR)
 			continue;
 
 		if (strncmp(dir_ent->d_name, "renderD", 7))
 			continue;
 
-		ret = asprintf(&rendernode_name, "/dev/dri/%s", dir_ent->d_name);
-		if (ret < 0)
+		if (snprintf(node->path, sizeof(node->path), "/dev/dri/%s", dir_ent->d_name) >=
+		    (int)sizeof(node->path))
 			continue;
 
-		fd = open(rendernode_name, O_RDWR | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
-		free(rendernode_name);
+		node->fd = -1;
+		node->threaded = !pthread_create(&node->thread, NULL, probe_node, node);
+		if (!node->threaded)
+			probe_node(node);
+		num_nodes++;
+	}
 
-		if (fd < 0)
-			continue;
+	closedir(dir);
 
-		memset(&info, 0, sizeof(info));
-		if (detect_device_info(0, fd, &info) < 0) {
-			close(fd);
-			fd = -1;
+	for (i = 0; i < num_nodes; i++) {
+		if (nodes[i].threaded)
+			pthread_join(nodes[i].thread, NULL);
+	}
+
+	for (i = 0; i < num_nodes; i++) {
+		uint32_t flags = nodes[i].info.dev_type_flags;
+
+		if (nodes[i].fd < 0 || nodes[i].ret < 0)
 			continue;
-		}
 
-		if (info.dev_type_flags & GBM_DEV_TYPE_FLAG_BLOCKED) {
-			close(fd);
-			fd = -1;
+		if ((flags & GBM_DEV_TYPE_FLAG_BLOCKED) || !(flags & GBM_DEV_TYPE_FLAG_DISPLAY))
 			continue;
+
+		if (!(flags & GBM_DEV_TYPE_FLAG_DISCRETE)) {
+			chosen = i;
+			break;
 		}
 
-		if (!(info.dev_type_flags & GBM_DEV_TYPE_FLAG_DISPLAY)) {
-			close(fd);
-			fd = -1;
-			continue;
+		if (discrete < 0)
+			discrete = i;
+	}
+
+	if (chosen < 0)
+		chosen = discrete;
+
+	for (i = 0; i < num_nodes; i++) {
+		if ((int)i == chosen) {
+			fd = nodes[i].fd;
+			snprintf(path, len, "%s", nodes[i].path);
+		} else if (nodes[i].fd >= 0) {
+			close(nodes[i].fd);
 		}
+	}
 
-		if (info.dev_type_flags & GBM_DEV_TYPE_FLAG_DISCRETE) {
-			if (dfd < 0)
-				dfd = fd;
-			else
-				close(fd);
-			fd = -1;
-		} else {
-			if (dfd >= 0) {
-				close(dfd);
-				dfd = -1;
-			}
-			break;
+	free(nodes);
+	return fd;
+}
+
+static int gbm_get_default_device_fd(void)
+{
+	int fd;
+	bool cached;
+	int64_t start, elapsed;
+	char cache_path[PATH_MAX];
+	char path[64];
+	struct device_cache_entry entry;
+
+	start = now_us();
+	cached = !device_cache_path(cache_path, sizeof(cache_path));
+
+	if (cached) {
+		fd = device_cache_open(cache_path, &entry);
+		if (fd >= 0) {
+			elapsed = now_us() - start;
+			drv_logd("default device %s: cache hit in %lld us, saved %lld us of probing\n",
+				 entry.path, (long long)elapsed, (long long)(entry.probe_us - elapsed));
+			return fd;
 		}
 	}
 
-	closedir(dir);
+	fd = gbm_probe_default_device_fd(path, sizeof(path));
+	elapsed = now_us() - start;
+	if (fd < 0)
+		return fd;
 
-	if (dfd >= 0)
-		return dfd;
+	drv_logd("default device %s: probed in %lld us\n", path, (long long)elapsed);
+	if (cached)
+		device_cache_store(cache_path, fd, path, elapsed);
 
 	return fd;
 }
@@ -375,3 +600,161 @@ PUBLIC struct gbm_device *minigbm_create_default_device(int *out_fd)
 
 	return gbm;
 }
+
+static int connector_monitor_probe(struct gbm_connector_monitor *monitor)
+{
+	int ret;
+	struct gbm_device_info info;
+
+	memset(&info, 0, sizeof(info));
+	info.dri_node_num = monitor->dri_node_num;
+	ret = detect_device_info(GBM_DETECT_FLAG_CONNECTED, monitor->fd, &info);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&monitor->lock);
+	ret = memcmp(&info, &monitor->info, sizeof(info)) != 0;
+	monitor->info = info;
+	pthread_mutex_unlock(&monitor->lock);
+
+	return ret;
+}
+
+/*
+ * Returns true if a uevent is a DRM hotplug event for the monitored device. Hotplug events come
+ * from the primary node, so they are matched on the normalized node number.
+ */
+static bool connector_monitor_uevent_matches(struct gbm_connector_monitor *monitor,
+					     const char *buf, size_t len)
+{
+	bool drm = false, hotplug = false;
+	int node = -1;
+	size_t i = 0;
+
+	while (i < len) {
+		const char *key = buf + i;
+		size_t key_len = strnlen(key, len - i);
+
+		if (!strcmp(key, "SUBSYSTEM=drm"))
+			drm = true;
+		else if (!strcmp(key, "HOTPLUG=1"))
+			hotplug = true;
+		else if (!strncmp(key, "DEVNAME=", 8))
+			node = dri_node_num(key + 8);
+
+		i += key_len + 1;
+	}
+
+	return drm && hotplug && (node < 0 || node == monitor->dri_node_num);
+}
+
+static int connector_monitor_open_netlink(void)
+{
+	int fd;
+	struct sockaddr_nl addr = { 0 };
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -errno;
+
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; /* kernel uevents */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+PUBLIC struct gbm_connector_monitor *gbm_connector_monitor_create_with_uevent_fd(int fd,
+										 int uevent_fd)
+{
+	struct gbm_connector_monitor *monitor;
+
+	monitor = calloc(1, sizeof(*monitor));
+	if (!monitor)
+		return NULL;
+
+	monitor->fd = fd;
+	monitor->uevent_fd = uevent_fd;
+	monitor->dri_node_num = fd_node_num(fd);
+	pthread_mutex_init(&monitor->lock, NULL);
+
+	if (connector_monitor_probe(monitor) < 0) {
+		gbm_connector_monitor_destroy(monitor);
+		return NULL;
+	}
+
+	return monitor;
+}
+
+PUBLIC struct gbm_connector_monitor *gbm_connector_monitor_create(int fd)
+{
+	int uevent_fd = connector_monitor_open_netlink();
+
+	/* Without uevents the monitor still answers queries; it is only refreshed on request. */
+	if (uevent_fd < 0)
+		drv_logi("Failed to open uevent socket: %s\n", strerror(-uevent_fd));
+
+	return gbm_connector_monitor_create_with_uevent_fd(fd, uevent_fd);
+}
+
+PUBLIC void gbm_connector_monitor_destroy(struct gbm_connector_monitor *monitor)
+{
+	if (monitor->uevent_fd >= 0)
+		close(monitor->uevent_fd);
+	pthread_mutex_destroy(&monitor->lock);
+	free(monitor);
+}
+
+PUBLIC int gbm_connector_monitor_get_fd(struct gbm_connector_monitor *monitor)
+{
+	return monitor->uevent_fd;
+}
+
+PUBLIC int gbm_connector_monitor_dispatch(struct gbm_connector_monitor *monitor)
+{
+	char buf[UEVENT_BUFFER_SIZE];
+	bool hotplug = false;
+	ssize_t len;
+
+	if (monitor->uevent_fd < 0)
+		return 0;
+
+	while ((len = recv(monitor->uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+		buf[len] = '\0';
+		if (connector_monitor_uevent_matches(monitor, buf, len))
+			hotplug = true;
+	}
+
+	if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return -errno;
+
+	/* A burst of hotplug events only needs one probe. */
+	return hotplug ? connector_monitor_probe(monitor) : 0;
+}
+
+PUBLIC int gbm_connector_monitor_refresh(struct gbm_connector_monitor *monitor)
+{
+	return connector_monitor_probe(monitor);
+}
+
+PUBLIC int gbm_connector_monitor_get_info(struct gbm_connector_monitor *monitor,
+					  struct gbm_device_info *info)
+{
+	int ret;
+
+	if (!info)
+		return -EINVAL;
+
+	ret = gbm_connector_monitor_dispatch(monitor);
+	if (ret < 0)
+		return ret;
+
+	pthread_mutex_lock(&monitor->lock);
+	*info = monitor->info;
+	pthread_mutex_unlock(&monitor->lock);
+
+	return 0;
+}
@@ -35,6 +35,27 @@ int gbm_detect_device_info(unsigned int detect_flags, int fd, struct gbm_device_
 int gbm_detect_device_info_path(unsigned int detect_flags, const char *dev_node,
 				struct gbm_device_info *info);
 
+/*
+ * Connector monitor. Keeps the result of gbm_detect_device_info(GBM_DETECT_FLAG_CONNECTED) for a
+ * device cached and re-probes only when a DRM hotplug uevent for the device arrives, so the
+ * connectors/connected counts can be queried cheaply. The DRM fd must outlive the monitor.
+ */
+struct gbm_connector_monitor;
+
+struct gbm_connector_monitor *gbm_connector_monitor_create(int fd);
+/* Reads uevents from uevent_fd instead of a kernel netlink socket. Takes ownership of it. */
+struct gbm_connector_monitor *gbm_connector_monitor_create_with_uevent_fd(int fd, int uevent_fd);
+void gbm_connector_monitor_destroy(struct gbm_connector_monitor *monitor);
+/* Becomes readable when uevents are pending. -1 if uevents are unavailable. */
+int gbm_connector_monitor_get_fd(struct gbm_connector_monitor *monitor);
+/* Drains pending uevents. Returns 1 if the cached state changed, 0 if not, or negative errno. */
+int gbm_connector_monitor_dispatch(struct gbm_connector_monitor *monitor);
+/* Re-probes connectors unconditionally. Same return values as dispatch. */
+int gbm_connector_monitor_refresh(struct gbm_connector_monitor *monitor);
+/* Returns the cached device info after handling pending uevents. */
+int gbm_connector_monitor_get_info(struct gbm_connector_monitor *monitor,
+				   struct gbm_device_info *info);
+
 /*
  * Create "default" gbm device.
  */
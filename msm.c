@@ -195,6 +195,7 @@ static void msm_add_ubwc_combinations(struct driver *drv, const uint32_t *format
 						     .metadata = *metadata,
 						     .use_flags = use_flags };
 			drv_array_append(drv->combos, &combo);
+			drv->format_table_stale = true;
 		}
 	}
 }
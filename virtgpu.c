@@ -5,12 +5,17 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
+#include "drv_helpers.h"
 #include "drv_priv.h"
 #include "external/virtgpu_drm.h"
 #include "util.h"
@@ -30,6 +35,168 @@ struct virtgpu_param params[] = {
 	PARAM(VIRTGPU_PARAM_RESOURCE_SYNC),	   PARAM(VIRTGPU_PARAM_GUEST_VRAM),
 };
 
+#define CAPSET_CACHE_MAGIC 0x43475643 /* "CVGC" */
+#define CAPSET_CACHE_VERSION 2
+
+/*
+ * On-disk capset cache entry. A capset is only reused when every field of the header matches:
+ * the virtgpu params are reported by the host and catch changes of its feature set, the VMM
+ * identity from DMI catches a guest moved to a different VMM, and the guest boot id and kernel
+ * release flush the cache on every guest boot and kernel update.
+ *
+ * Nothing in the guest identifies the host session itself, so a host or VMM that is updated or
+ * restarted underneath a running guest (e.g. snapshot restore or live migration) without
+ * changing any of the above keeps getting the old capsets. Systems that do that must clear the
+ * cache directory when the host changes, or leave the cache off.
+ */
+struct virtgpu_capset_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cap_set_id;
+	uint32_t cap_set_ver;
+	uint32_t size;
+	uint32_t params[param_max];
+	char vmm[128];
+	char boot_id[40];
+	char release[65];
+};
+
+/* Appends the contents of a DMI id file; systems without DMI leave |buf| as it is. */
+static void virtgpu_append_dmi_id(char *buf, size_t len, const char *name)
+{
+	int fd;
+	ssize_t ret;
+	char path[64];
+	size_t used = strlen(buf);
+
+	if (used + 1 >= len)
+		return;
+
+	snprintf(path, sizeof(path), "/sys/class/dmi/id/%s", name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	ret = read(fd, buf + used, len - used - 1);
+	if (ret > 0)
+		buf[used + ret] = '\0';
+	close(fd);
+}
+
+static int virtgpu_capset_cache_path(uint32_t cap_set_id, char *path, size_t len)
+{
+	const char *dir = drv_get_os_option("MINIGBM_VIRTGPU_CAPSET_CACHE_DIR");
+	if (!dir)
+		return -ENOENT;
+
+	snprintf(path, len, "%s/minigbm_capset_%u.bin", dir, cap_set_id);
+	return 0;
+}
+
+static void virtgpu_capset_cache_header_init(struct virtgpu_capset_cache_header *header,
+					     const struct drm_virtgpu_get_caps *args)
+{
+	int fd;
+	struct utsname uts;
+
+	memset(header, 0, sizeof(*header));
+	header->magic = CAPSET_CACHE_MAGIC;
+	header->version = CAPSET_CACHE_VERSION;
+	header->cap_set_id = args->cap_set_id;
+	header->cap_set_ver = args->cap_set_ver;
+	header->size = args->size;
+
+	for (uint32_t i = 0; i < param_max; i++)
+		header->params[i] = params[i].value;
+
+	virtgpu_append_dmi_id(header->vmm, sizeof(header->vmm), "sys_vendor");
+	virtgpu_append_dmi_id(header->vmm, sizeof(header->vmm), "product_name");
+	virtgpu_append_dmi_id(header->vmm, sizeof(header->vmm), "product_version");
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (read(fd, header->boot_id, sizeof(header->boot_id) - 1) < 0)
+			header->boot_id[0] = '\0';
+		close(fd);
+	}
+
+	if (!uname(&uts))
+		snprintf(header->release, sizeof(header->release), "%s", uts.release);
+}
+
+static bool virtgpu_capset_cache_load(const struct drm_virtgpu_get_caps *args)
+{
+	int fd;
+	bool hit = false;
+	char path[PATH_MAX];
+	struct virtgpu_capset_cache_header expected, header;
+
+	if (virtgpu_capset_cache_path(args->cap_set_id, path, sizeof(path)))
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	virtgpu_capset_cache_header_init(&expected, args);
+	if (read(fd, &header, sizeof(header)) == sizeof(header) &&
+	    !memcmp(&header, &expected, sizeof(header)))
+		hit = read(fd, (void *)(uintptr_t)args->addr, args->size) == (ssize_t)args->size;
+
+	close(fd);
+	return hit;
+}
+
+static void virtgpu_capset_cache_store(const struct drm_virtgpu_get_caps *args)
+{
+	int fd;
+	bool ok;
+	char path[PATH_MAX], tmp_path[PATH_MAX + 16];
+	struct virtgpu_capset_cache_header header;
+
+	if (virtgpu_capset_cache_path(args->cap_set_id, path, sizeof(path)))
+		return;
+
+	// Write to a private file and rename so that concurrent readers never see a partial entry.
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+
+	virtgpu_capset_cache_header_init(&header, args);
+	ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+	     write(fd, (void *)(uintptr_t)args->addr, args->size) == (ssize_t)args->size;
+	close(fd);
+
+	if (!ok || rename(tmp_path, path)) {
+		drv_logi("Failed to store capset cache %s\n", path);
+		unlink(tmp_path);
+	}
+}
+
+int virtgpu_get_caps(struct driver *drv, struct drm_virtgpu_get_caps *args)
+{
+	int ret = 0;
+	bool cached;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	cached = virtgpu_capset_cache_load(args);
+	if (!cached) {
+		ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, args);
+		if (!ret)
+			virtgpu_capset_cache_store(args);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	drv_logd("capset %u: %s in %lld us\n", args->cap_set_id, cached ? "cache hit" : "queried",
+		 (long long)(end.tv_sec - start.tv_sec) * 1000000 +
+		     (end.tv_nsec - start.tv_nsec) / 1000);
+
+	return ret;
+}
+
 extern const struct backend virtgpu_virgl;
 extern const struct backend virtgpu_cross_domain;
 
@@ -29,3 +29,12 @@ enum virtgpu_param_id {
 #define VIRTIO_GPU_CAPSET_GFXSTREAM_VULKAN 3
 #define VIRTIO_GPU_CAPSET_VENUS 4
 #define VIRTIO_GPU_CAPSET_CROSS_DOMAIN 5
+
+struct driver;
+struct drm_virtgpu_get_caps;
+
+/*
+ * DRM_IOCTL_VIRTGPU_GET_CAPS, served from the on-disk capset cache when
+ * MINIGBM_VIRTGPU_CAPSET_CACHE_DIR is set and the cached entry matches the current boot.
+ */
+int virtgpu_get_caps(struct driver *drv, struct drm_virtgpu_get_caps *args);
@@ -5,6 +5,7 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <xf86drm.h>
@@ -31,11 +32,26 @@ static const uint32_t texture_only_formats[] = {
 
 extern struct virtgpu_param params[];
 
+/*
+ * A metadata query that has been sent to the host but not answered yet. Threads asking for the
+ * same metadata wait on it instead of issuing a duplicate query. Protected by
+ * metadata_cache_lock; freed by whoever drops the last reference.
+ */
+struct cross_domain_query {
+	struct bo_metadata metadata;
+	int ret;
+	bool done;
+	uint32_t refcount;
+};
+
 struct cross_domain_private {
 	uint32_t ring_handle;
 	void *ring_addr;
+	pthread_mutex_t ring_lock;
 	struct drv_array *metadata_cache;
+	struct drv_array *pending_queries;
 	pthread_mutex_t metadata_cache_lock;
+	pthread_cond_t metadata_query_cond;
 	bool mt8183_camera_quirk_;
 };
 
@@ -61,7 +77,12 @@ static void cross_domain_release_private(struct driver *drv)
 	if (priv->metadata_cache)
 		drv_array_destroy(priv->metadata_cache);
 
+	if (priv->pending_queries)
+		drv_array_destroy(priv->pending_queries);
+
+	pthread_cond_destroy(&priv->metadata_query_cond);
 	pthread_mutex_destroy(&priv->metadata_cache_lock);
+	pthread_mutex_destroy(&priv->ring_lock);
 
 	free(priv);
 }
@@ -145,26 +166,18 @@ static bool metadata_equal(struct bo_metadata *current, struct bo_metadata *cach
 	return false;
 }
 
-static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *metadata)
+// Sends CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS and reads the answer back from the query ring.
+// The host always writes the answer to the start of the ring, so round trips are serialized on
+// ring_lock; metadata_cache_lock is not held here.
+static int cross_domain_query_host(struct driver *drv, struct bo_metadata *metadata)
 {
-	int ret = 0;
-	struct bo_metadata *cached_data = NULL;
+	int ret;
 	struct cross_domain_private *priv = drv->priv;
 	struct CrossDomainGetImageRequirements cmd_get_reqs;
 	uint32_t *addr = (uint32_t *)priv->ring_addr;
 	uint32_t plane;
 
 	memset(&cmd_get_reqs, 0, sizeof(cmd_get_reqs));
-	pthread_mutex_lock(&priv->metadata_cache_lock);
-	for (uint32_t i = 0; i < drv_array_size(priv->metadata_cache); i++) {
-		cached_data = (struct bo_metadata *)drv_array_at_idx(priv->metadata_cache, i);
-		if (!metadata_equal(metadata, cached_data))
-			continue;
-
-		memcpy(metadata, cached_data, sizeof(*cached_data));
-		goto out_unlock;
-	}
-
 	cmd_get_reqs.hdr.cmd = CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS;
 	cmd_get_reqs.hdr.cmd_size = sizeof(struct CrossDomainGetImageRequirements);
 
@@ -182,17 +195,13 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 		cmd_get_reqs.flags |= BO_USE_LINEAR;
 	}
 
-	/*
-	 * It is possible to avoid blocking other bo_create() calls by unlocking before
-	 * cross_domain_submit_cmd() and re-locking afterwards.  However, that would require
-	 * another scan of the metadata cache before drv_array_append in case two bo_create() calls
-	 * do the same metadata query.  Until cross_domain functionality is more widely tested,
-	 * leave this optimization out for now.
-	 */
+	pthread_mutex_lock(&priv->ring_lock);
 	ret = cross_domain_submit_cmd(drv, (uint32_t *)&cmd_get_reqs, cmd_get_reqs.hdr.cmd_size,
 				      true);
-	if (ret < 0)
-		goto out_unlock;
+	if (ret < 0) {
+		pthread_mutex_unlock(&priv->ring_lock);
+		return ret;
+	}
 
 	memcpy(&metadata->strides, &addr[0], 4 * sizeof(uint32_t));
 	memcpy(&metadata->offsets, &addr[4], 4 * sizeof(uint32_t));
@@ -203,6 +212,7 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	metadata->map_info = addr[13];
 	metadata->memory_idx = addr[14];
 	metadata->physical_device_idx = addr[15];
+	pthread_mutex_unlock(&priv->ring_lock);
 
 	for (plane = 1; plane < metadata->num_planes; plane++) {
 		metadata->sizes[plane - 1] =
@@ -210,10 +220,88 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	}
 	metadata->sizes[plane - 1] = metadata->total_size - metadata->offsets[plane - 1];
 
-	drv_array_append(priv->metadata_cache, metadata);
+	return 0;
+}
+
+static void cross_domain_query_put(struct cross_domain_query *query)
+{
+	if (!--query->refcount)
+		free(query);
+}
+
+static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *metadata)
+{
+	int ret;
+	struct bo_metadata *cached_data = NULL;
+	struct cross_domain_private *priv = drv->priv;
+	struct cross_domain_query *query = NULL;
+	uint32_t i;
+
+	pthread_mutex_lock(&priv->metadata_cache_lock);
+	for (i = 0; i < drv_array_size(priv->metadata_cache); i++) {
+		cached_data = (struct bo_metadata *)drv_array_at_idx(priv->metadata_cache, i);
+		if (!metadata_equal(metadata, cached_data))
+			continue;
+
+		memcpy(metadata, cached_data, sizeof(*cached_data));
+		pthread_mutex_unlock(&priv->metadata_cache_lock);
+		return 0;
+	}
+
+	// Someone is already asking the host for this metadata, wait for their answer.
+	for (i = 0; i < drv_array_size(priv->pending_queries); i++) {
+		query = *(struct cross_domain_query **)drv_array_at_idx(priv->pending_queries, i);
+		if (!metadata_equal(metadata, &query->metadata))
+			continue;
 
-out_unlock:
+		query->refcount++;
+		while (!query->done)
+			pthread_cond_wait(&priv->metadata_query_cond, &priv->metadata_cache_lock);
+
+		ret = query->ret;
+		if (!ret)
+			memcpy(metadata, &query->metadata, sizeof(*metadata));
+
+		cross_domain_query_put(query);
+		pthread_mutex_unlock(&priv->metadata_cache_lock);
+		return ret;
+	}
+
+	query = calloc(1, sizeof(*query));
+	if (!query) {
+		pthread_mutex_unlock(&priv->metadata_cache_lock);
+		return -ENOMEM;
+	}
+
+	query->metadata = *metadata;
+	query->refcount = 1;
+	drv_array_append(priv->pending_queries, &query);
 	pthread_mutex_unlock(&priv->metadata_cache_lock);
+
+	// Cache hits and queries for the same metadata don't wait for this round trip, but queries
+	// for distinct metadata still serialize on ring_lock, as the host has one answer slot.
+	ret = cross_domain_query_host(drv, metadata);
+
+	pthread_mutex_lock(&priv->metadata_cache_lock);
+	for (i = 0; i < drv_array_size(priv->pending_queries); i++) {
+		if (*(struct cross_domain_query **)drv_array_at_idx(priv->pending_queries, i) ==
+		    query) {
+			drv_array_remove(priv->pending_queries, i);
+			break;
+		}
+	}
+
+	if (!ret) {
+		drv_array_append(priv->metadata_cache, metadata);
+		query->metadata = *metadata;
+	}
+
+	query->ret = ret;
+	query->done = true;
+	pthread_cond_broadcast(&priv->metadata_query_cond);
+	cross_domain_query_put(query);
+	pthread_mutex_unlock(&priv->metadata_cache_lock);
+
 	return ret;
 }
 
@@ -270,20 +358,24 @@ static int cross_domain_init(struct driver *drv)
 		return ret;
 	}
 
+	pthread_mutex_init(&priv->ring_lock, NULL);
+	pthread_cond_init(&priv->metadata_query_cond, NULL);
+
+	priv->ring_addr = MAP_FAILED;
+	drv->priv = priv;
+
 	priv->metadata_cache = drv_array_init(sizeof(struct bo_metadata));
-	if (!priv->metadata_cache) {
+	priv->pending_queries = drv_array_init(sizeof(struct cross_domain_query *));
+	if (!priv->metadata_cache || !priv->pending_queries) {
 		ret = -ENOMEM;
 		goto free_private;
 	}
 
-	priv->ring_addr = MAP_FAILED;
-	drv->priv = priv;
-
 	args.cap_set_id = VIRTIO_GPU_CAPSET_CROSS_DOMAIN;
 	args.size = sizeof(struct CrossDomainCapabilities);
 	args.addr = (unsigned long long)&cross_domain_caps;
 
-	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &args);
+	ret = virtgpu_get_caps(drv, &args);
 	if (ret) {
 		drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
 		goto free_private;
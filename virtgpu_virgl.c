@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/dma-buf.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdint.h>
@@ -81,6 +82,23 @@ struct virgl_priv {
 	struct lru virgl_blob_metadata_cache;
 };
 
+/* Kept in bo->priv of 3D and blob bos. */
+struct virgl_bo_priv {
+	/* Host resource id, which transfer commands name the resource by. */
+	uint32_t res_handle;
+};
+
+static int virgl_bo_set_res_handle(struct bo *bo, uint32_t res_handle)
+{
+	struct virgl_bo_priv *bo_priv = calloc(1, sizeof(*bo_priv));
+	if (!bo_priv)
+		return -ENOMEM;
+
+	bo_priv->res_handle = res_handle;
+	bo->priv = bo_priv;
+	return 0;
+}
+
 static uint32_t translate_format(uint32_t drm_fourcc)
 {
 	switch (drm_fourcc) {
@@ -255,6 +273,30 @@ struct virtio_transfers_params {
 	struct rectangle xfer_boxes[DRV_MAX_PLANES];
 };
 
+// Emulated planes are stacked vertically in a single R8 resource, so boxes that share x and
+// width and touch vertically describe one contiguous sub-image. Collapse those so that e.g. the
+// U and V planes of a bottom-aligned YV12 rect cost a single transfer.
+static void virgl_merge_transfer_boxes(struct virtio_transfers_params *xfer_params)
+{
+	size_t i, merged = 0;
+
+	for (i = 1; i < xfer_params->xfers_needed; i++) {
+		struct rectangle *prev = &xfer_params->xfer_boxes[merged];
+		const struct rectangle *cur = &xfer_params->xfer_boxes[i];
+
+		if (cur->x == prev->x && cur->width == prev->width &&
+		    cur->y == prev->y + prev->height) {
+			prev->height += cur->height;
+			continue;
+		}
+
+		xfer_params->xfer_boxes[++merged] = *cur;
+	}
+
+	if (xfer_params->xfers_needed)
+		xfer_params->xfers_needed = merged + 1;
+}
+
 static void virgl_get_emulated_transfers_params(const struct bo *bo,
 						const struct rectangle *transfer_box,
 						struct virtio_transfers_params *xfer_params)
@@ -326,6 +368,8 @@ static void virgl_get_emulated_transfers_params(const struct bo *bo,
 
 		break;
 	}
+
+	virgl_merge_transfer_boxes(xfer_params);
 }
 
 static bool virgl_supports_combination_natively(struct driver *drv, uint32_t drm_format,
@@ -543,7 +587,11 @@ static int virgl_3d_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 
 	bo->handle.u32 = res_create.bo_handle;
 
-	return 0;
+	ret = virgl_bo_set_res_handle(bo, res_create.res_handle);
+	if (ret)
+		drv_gem_bo_destroy(bo);
+
+	return ret;
 }
 
 static void *virgl_3d_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
@@ -614,7 +662,7 @@ static int virgl_get_caps(struct driver *drv, struct virgl_priv *priv)
 		cap_args.size = sizeof(struct virgl_caps_v1);
 	}
 
-	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &cap_args);
+	ret = virtgpu_get_caps(drv, &cap_args);
 	if (ret) {
 		drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
 		priv->caps_is_v2 = 0;
@@ -625,7 +673,7 @@ static int virgl_get_caps(struct driver *drv, struct virgl_priv *priv)
 		cap_args.cap_set_id = VIRTIO_GPU_CAPSET_VIRGL;
 		cap_args.size = sizeof(struct virgl_caps_v1);
 
-		ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &cap_args);
+		ret = virtgpu_get_caps(drv, &cap_args);
 		if (ret)
 			drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
 	}
@@ -779,7 +827,7 @@ static bool virgl_blob_metadata_eq(struct lru_entry *entry, void *data)
 
 static int virgl_blob_do_create(struct driver *drv, uint32_t width, uint32_t height,
 				uint32_t use_flags, uint32_t virgl_format, uint32_t total_size,
-				uint32_t *bo_handle)
+				uint32_t *bo_handle, uint32_t *res_handle)
 {
 	int ret;
 	uint32_t cur_blob_id;
@@ -814,6 +862,8 @@ static int virgl_blob_do_create(struct driver *drv, uint32_t width, uint32_t hei
 	}
 
 	*bo_handle = drm_rc_blob.bo_handle;
+	if (res_handle)
+		*res_handle = drm_rc_blob.res_handle;
 	return 0;
 }
 
@@ -857,7 +907,7 @@ static int virgl_blob_get_host_format(struct driver *drv, struct bo_metadata *me
 			uint32_t handle;
 			int ret =
 			    virgl_blob_do_create(drv, meta->width, meta->height, meta->use_flags,
-						 virgl_format, total_size, &handle);
+						 virgl_format, total_size, &handle, NULL);
 			if (ret) {
 				pthread_mutex_unlock(&priv->host_blob_format_lock);
 				return ret;
@@ -918,16 +968,21 @@ static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 	int ret;
 	uint32_t virgl_format = translate_format(bo->meta.format);
 	uint32_t bo_handle;
+	uint32_t res_handle;
 
 	virgl_blob_get_host_format(drv, &bo->meta);
 	ret = virgl_blob_do_create(drv, bo->meta.width, bo->meta.height, bo->meta.use_flags,
-				   virgl_format, bo->meta.total_size, &bo_handle);
+				   virgl_format, bo->meta.total_size, &bo_handle, &res_handle);
 	if (ret)
 		return ret;
 
 	bo->handle.u32 = bo_handle;
 
-	return 0;
+	ret = virgl_bo_set_res_handle(bo, res_handle);
+	if (ret)
+		drv_gem_bo_destroy(bo);
+
+	return ret;
 }
 
 static bool should_use_blob(struct driver *drv, uint32_t format, uint64_t use_flags)
@@ -998,8 +1053,36 @@ static int virgl_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_
 	return -EINVAL;
 }
 
+static int virgl_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+	struct drm_virtgpu_resource_info res_info = { 0 };
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret || !params[param_3d].value)
+		return ret;
+
+	res_info.bo_handle = bo->handle.u32;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &res_info);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		ret = -errno;
+		drv_gem_bo_destroy(bo);
+		return ret;
+	}
+
+	ret = virgl_bo_set_res_handle(bo, res_info.res_handle);
+	if (ret)
+		drv_gem_bo_destroy(bo);
+
+	return ret;
+}
+
 static int virgl_bo_destroy(struct bo *bo)
 {
+	free(bo->priv);
+	bo->priv = NULL;
+
 	if (params[param_3d].value)
 		return drv_gem_bo_destroy(bo);
 	else
@@ -1044,6 +1127,57 @@ static bool is_arc_screen_capture_bo(struct bo *bo)
 	return strstr(tmp, "ARC-SCREEN-CAP");
 }
 
+static bool virgl_supports_transfer_cmd(struct virgl_priv *priv)
+{
+	return priv->caps_is_v2 && (priv->caps.v2.capability_bits & VIRGL_CAP_TRANSFER);
+}
+
+// Encodes every box as a VIRGL_CCMD_TRANSFER3D and submits them in a single execbuffer, so an
+// emulated multi-planar transfer costs one guest->host exit instead of one per plane. The bo is
+// listed in the execbuffer so that DRM_IOCTL_VIRTGPU_WAIT on it covers all of the transfers.
+// Unlike the transfer ioctls, the command carries the guest strides, so the level is always 0.
+static int virgl_submit_transfers(struct bo *bo, uint32_t direction, uint32_t offset,
+				  const struct virtio_transfers_params *xfer_params)
+{
+	int ret;
+	size_t i;
+	uint32_t bo_handle = bo->handle.u32;
+	uint32_t cmd[DRV_MAX_PLANES * (VIRGL_TRANSFER3D_SIZE + 1)] = { 0 };
+	struct virgl_bo_priv *bo_priv = (struct virgl_bo_priv *)bo->priv;
+	struct drm_virtgpu_execbuffer exec = { 0 };
+
+	for (i = 0; i < xfer_params->xfers_needed; i++) {
+		uint32_t *xfer_cmd = &cmd[i * (VIRGL_TRANSFER3D_SIZE + 1)];
+
+		xfer_cmd[0] = VIRGL_CMD0(VIRGL_CCMD_TRANSFER3D, 0, VIRGL_TRANSFER3D_SIZE);
+		xfer_cmd[VIRGL_RESOURCE_IW_RES_HANDLE] = bo_priv->res_handle;
+		xfer_cmd[VIRGL_RESOURCE_IW_LEVEL] = 0;
+		xfer_cmd[VIRGL_RESOURCE_IW_STRIDE] = bo->meta.strides[0];
+		xfer_cmd[VIRGL_RESOURCE_IW_LAYER_STRIDE] = bo->meta.total_size;
+		xfer_cmd[VIRGL_RESOURCE_IW_X] = xfer_params->xfer_boxes[i].x;
+		xfer_cmd[VIRGL_RESOURCE_IW_Y] = xfer_params->xfer_boxes[i].y;
+		xfer_cmd[VIRGL_RESOURCE_IW_W] = xfer_params->xfer_boxes[i].width;
+		xfer_cmd[VIRGL_RESOURCE_IW_H] = xfer_params->xfer_boxes[i].height;
+		xfer_cmd[VIRGL_RESOURCE_IW_D] = 1;
+		xfer_cmd[VIRGL_TRANSFER3D_DATA_OFFSET] = offset;
+		xfer_cmd[VIRGL_TRANSFER3D_DIRECTION] = direction;
+	}
+
+	exec.command = (uint64_t)(uintptr_t)cmd;
+	exec.size = sizeof(uint32_t) * (VIRGL_TRANSFER3D_SIZE + 1) * xfer_params->xfers_needed;
+	exec.bo_handles = (uint64_t)(uintptr_t)&bo_handle;
+	exec.num_bo_handles = 1;
+	exec.fence_fd = -1;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
 static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
@@ -1117,18 +1251,25 @@ static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
 		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
 	}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
-				 strerror(errno));
-			return -errno;
+	if (xfer_params.xfers_needed > 1 && virgl_supports_transfer_cmd(priv)) {
+		ret = virgl_submit_transfers(bo, VIRGL_TRANSFER_FROM_HOST, xfer.offset,
+					     &xfer_params);
+		if (ret)
+			return ret;
+	} else {
+		for (i = 0; i < xfer_params.xfers_needed; i++) {
+			xfer.box.x = xfer_params.xfer_boxes[i].x;
+			xfer.box.y = xfer_params.xfer_boxes[i].y;
+			xfer.box.w = xfer_params.xfer_boxes[i].width;
+			xfer.box.h = xfer_params.xfer_boxes[i].height;
+			xfer.box.d = 1;
+
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
 		}
 	}
 
@@ -1145,7 +1286,37 @@ static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
-static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
+/*
+ * Snapshots the fences attached to the bo as a sync_file. The kernel attaches the fence of
+ * every transfer to the bo, so this signals once the transfers submitted so far complete.
+ */
+static int virgl_bo_export_fence(struct bo *bo, int *out_fence)
+{
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	struct dma_buf_export_sync_file args = {
+		.flags = DMA_BUF_SYNC_WRITE,
+		.fd = -1,
+	};
+	int prime_fd, ret;
+
+	if (drmPrimeHandleToFD(bo->drv->fd, bo->handle.u32, DRM_CLOEXEC, &prime_fd))
+		return -errno;
+
+	ret = drmIoctl(prime_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &args);
+	if (ret)
+		ret = -errno;
+	close(prime_fd);
+	if (ret)
+		return ret;
+
+	*out_fence = args.fd;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static int virgl_bo_flush_fence(struct bo *bo, struct mapping *mapping, int *out_fence)
 {
 	int ret;
 	size_t i;
@@ -1193,26 +1364,36 @@ static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
 		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
 	}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
-				 strerror(errno));
-			return -errno;
+	if (xfer_params.xfers_needed > 1 && virgl_supports_transfer_cmd(priv)) {
+		ret = virgl_submit_transfers(bo, VIRGL_TRANSFER_TO_HOST, xfer.offset,
+					     &xfer_params);
+		if (ret)
+			return ret;
+	} else {
+		for (i = 0; i < xfer_params.xfers_needed; i++) {
+			xfer.box.x = xfer_params.xfer_boxes[i].x;
+			xfer.box.y = xfer_params.xfer_boxes[i].y;
+			xfer.box.w = xfer_params.xfer_boxes[i].width;
+			xfer.box.h = xfer_params.xfer_boxes[i].height;
+			xfer.box.d = 1;
+
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
 		}
 	}
 
 	// If the buffer is only accessed by the host GPU, then the flush is ordered
 	// with subsequent commands. However, if other host hardware can access the
-	// buffer, we need to wait for the transfer to complete for consistency.
-	// TODO(b/136733358): Support returning fences from transfers
+	// buffer, it must not be used before the transfer completes. Hand that off to
+	// the caller as a fence when possible, and wait otherwise.
 	if (bo->meta.use_flags & BO_USE_NON_GPU_HW) {
+		if (out_fence && !virgl_bo_export_fence(bo, out_fence))
+			return 0;
+
 		waitcmd.handle = bo->handle.u32;
 
 		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
@@ -1225,6 +1406,11 @@ static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return virgl_bo_flush_fence(bo, mapping, NULL);
+}
+
 static void virgl_3d_resolve_format_and_use_flags(struct driver *drv, uint32_t format,
 						  uint64_t use_flags, uint32_t *out_format,
 						  uint64_t *out_use_flags)
@@ -1372,11 +1558,12 @@ const struct backend virtgpu_virgl = { .name = "virtgpu_virgl",
 				       .bo_create = virgl_bo_create,
 				       .bo_create_with_modifiers = virgl_bo_create_with_modifiers,
 				       .bo_destroy = virgl_bo_destroy,
-				       .bo_import = drv_prime_bo_import,
+				       .bo_import = virgl_bo_import,
 				       .bo_map = virgl_bo_map,
 				       .bo_unmap = drv_bo_munmap,
 				       .bo_invalidate = virgl_bo_invalidate,
 				       .bo_flush = virgl_bo_flush,
+				       .bo_flush_fence = virgl_bo_flush_fence,
 				       .resolve_format_and_use_flags =
 					   virgl_resolve_format_and_use_flags,
 				       .resource_info = virgl_resource_info,